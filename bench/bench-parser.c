@@ -0,0 +1,329 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Microbenchmark for the timeline parser of bti.
+ *
+ * bti is a single file, so it is pulled in whole with its main() renamed
+ * and the static functions are called directly.  A timeline of generated
+ * statuses is parsed from memory, in the chunks curl would hand over,
+ * and printed to /dev/null: the way parse_statuses() used to do it (a
+ * whole document tree and a copy of every field), the streaming parser,
+ * and the streaming parser queueing every status the way a merge does.
+ * malloc(), calloc() and realloc() are counted here, so the allocations
+ * per status of each are printed along with the statuses per second.
+ *
+ *	bench-parser [STATUSES [RUNS]]
+ */
+
+#define main bti_main
+#include "../bti.c"
+#undef main
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations;
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+#define BENCH_CHUNK	(16 * 1024)
+
+static const char *words[] = {
+	"the", "build", "is", "broken", "again", "see", "ticket", "for",
+	"details", "deploying", "now", "dashboard", "looks", "fine", "to",
+	"me", "ping", "@gregkh", "#bti", "&amp;", "&lt;ok&gt;",
+	"http://example.com/x?a=1&amp;b=2",
+};
+
+static const char *days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri",
+			      "Sat" };
+static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+				"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/* The same statuses as the mock server sends, 97 authors taking turns */
+static char *make_timeline(int count, size_t *len)
+{
+	struct output *doc;
+	char buffer[512];
+	char *data;
+	time_t when;
+	struct tm tm;
+	int n;
+	int i;
+
+	doc = output_alloc(-1, OUTPUT_HUMAN);
+	output_string(doc, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		      "<statuses type=\"array\">\n");
+	for (n = 0; n < count; n++) {
+		when = 1220000000 - n * 37;
+		gmtime_r(&when, &tm);
+		snprintf(buffer, sizeof(buffer),
+			 "<status>\n  <created_at>%s %s %02d %02d:%02d:%02d "
+			 "+0000 %d</created_at>\n  <id>%d</id>\n  <text>",
+			 days[tm.tm_wday], months[tm.tm_mon], tm.tm_mday,
+			 tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_year + 1900,
+			 500000000 - n);
+		output_string(doc, buffer);
+		for (i = 0; i < 8 + n % 12; i++) {
+			if (i)
+				output_char(doc, ' ');
+			output_string(doc, words[(n * 7 + i * 13) %
+						 (sizeof(words) /
+						  sizeof(*words))]);
+		}
+		snprintf(buffer, sizeof(buffer),
+			 "</text>\n  <source>web</source>\n"
+			 "  <truncated>false</truncated>\n"
+			 "  <in_reply_to_status_id></in_reply_to_status_id>\n"
+			 "  <user>\n    <id>%d</id>\n"
+			 "    <name>Bench User %d</name>\n"
+			 "    <screen_name>user%d</screen_name>\n"
+			 "    <location>here</location>\n"
+			 "    <followers_count>%d</followers_count>\n"
+			 "  </user>\n</status>\n",
+			 1000 + n % 97, n % 97, n % 97, n % 5000);
+		output_string(doc, buffer);
+	}
+	output_string(doc, "</statuses>\n");
+
+	data = doc->data;
+	*len = doc->length;
+	doc->data = NULL;
+	output_free(doc);
+	return data;
+}
+
+/* What parse_statuses() did with every <status> of the document */
+static unsigned long parse_statuses_old(struct output *out, xmlDocPtr doc,
+					xmlNodePtr current)
+{
+	xmlChar *text = NULL;
+	xmlChar *user = NULL;
+	xmlChar *created = NULL;
+	xmlChar *id = NULL;
+	xmlNodePtr userinfo;
+	unsigned long printed = 0;
+
+	current = current->xmlChildrenNode;
+	while (current != NULL) {
+		if (current->type == XML_ELEMENT_NODE) {
+			if (!xmlStrcmp(current->name,
+				       (const xmlChar *)"created_at"))
+				created = xmlNodeListGetString(doc,
+						current->xmlChildrenNode, 1);
+			if (!xmlStrcmp(current->name, (const xmlChar *)"text"))
+				text = xmlNodeListGetString(doc,
+						current->xmlChildrenNode, 1);
+			if (!xmlStrcmp(current->name, (const xmlChar *)"id"))
+				id = xmlNodeListGetString(doc,
+						current->xmlChildrenNode, 1);
+			if (!xmlStrcmp(current->name, (const xmlChar *)"user")) {
+				userinfo = current->xmlChildrenNode;
+				while (userinfo != NULL) {
+					if (!xmlStrcmp(userinfo->name,
+						       (const xmlChar *)
+						       "screen_name")) {
+						if (user)
+							xmlFree(user);
+						user = xmlNodeListGetString(doc,
+							userinfo->xmlChildrenNode,
+							1);
+					}
+					userinfo = userinfo->next;
+				}
+			}
+
+			if (user && text && created) {
+				output_status(out, id ?
+					      strtoull((char *)id, NULL, 10) :
+					      0, (char *)created,
+					      (char *)user, (char *)text);
+				printed++;
+				xmlFree(user);
+				xmlFree(text);
+				xmlFree(created);
+				xmlFree(id);
+				user = NULL;
+				text = NULL;
+				created = NULL;
+				id = NULL;
+			}
+		}
+		current = current->next;
+	}
+	return printed;
+}
+
+static unsigned long parse_old(struct output *out, const char *data,
+			       size_t len)
+{
+	unsigned long printed = 0;
+	xmlNodePtr current;
+	xmlDocPtr doc;
+
+	doc = xmlReadMemory(data, len, "timeline.xml", NULL,
+			    XML_PARSE_NOERROR);
+	if (!doc)
+		return 0;
+	current = xmlDocGetRootElement(doc);
+	for (current = current->xmlChildrenNode; current;
+	     current = current->next)
+		if (!xmlStrcmp(current->name, (const xmlChar *)"status"))
+			printed += parse_statuses_old(out, doc, current);
+	xmlFreeDoc(doc);
+	return printed;
+}
+
+/*
+ * Print whatever the parser has queued, the way merge_flush() does for
+ * a merge of a single timeline.
+ */
+static unsigned long drain_queue(struct output *out,
+				 struct status_queue *queue)
+{
+	struct queued_status *status;
+	unsigned long printed = 0;
+
+	while ((status = status_queue_pop(queue))) {
+		output_status(out, status->id, status->created, status->user,
+			      status->text);
+		status_queue_release(queue, status);
+		printed++;
+	}
+	return printed;
+}
+
+static unsigned long parse_stream(struct session *session,
+				  struct output *out, const char *data,
+				  size_t len, struct status_queue *queue)
+{
+	struct timeline_parser *parser;
+	unsigned long printed = 0;
+	size_t offset;
+	size_t chunk;
+
+	parser = timeline_parser_alloc(session, out);
+	if (!parser)
+		return 0;
+	parser->queue = queue;
+	for (offset = 0; offset < len; offset += chunk) {
+		chunk = len - offset < BENCH_CHUNK ? len - offset : BENCH_CHUNK;
+		timeline_parser_feed(parser, data + offset, chunk, 0);
+		if (queue)
+			printed += drain_queue(out, queue);
+	}
+	timeline_parser_feed(parser, NULL, 0, 1);
+	if (queue) {
+		printed += drain_queue(out, queue);
+		status_queue_clear(queue);
+	} else {
+		printed = parser->printed;
+	}
+	timeline_parser_free(parser);
+	return printed;
+}
+
+static void report(const char *name, int count, unsigned long printed,
+		   unsigned long allocs, double elapsed)
+{
+	printf("%-8s %8d statuses %8lu printed %8.3f s %10.0f statuses/s "
+	       "%8.2f allocs/status\n", name, count, printed, elapsed,
+	       printed / elapsed, (double)allocs / count);
+}
+
+int main(int argc, char *argv[])
+{
+	int count = argc > 1 ? atoi(argv[1]) : 100000;
+	int runs = argc > 2 ? atoi(argv[2]) : 3;
+	struct session session = { .action = ACTION_FRIENDS };
+	struct status_queue queue = { };
+	struct name_table *names;
+	struct output *out;
+	unsigned long printed[3] = { };
+	unsigned long allocs;
+	double elapsed;
+	size_t len;
+	char *data;
+	int retval = 0;
+	int run;
+	int i;
+
+	if (count < 1)
+		count = 1;
+	if (runs < 1)
+		runs = 1;
+	data = make_timeline(count, &len);
+	out = output_alloc(open("/dev/null", O_WRONLY), OUTPUT_HUMAN);
+	names = name_table_alloc();
+	if (!data || !out || !names)
+		return 1;
+	queue.names = names;
+	printf("%d statuses, %zu bytes, best of %d runs\n", count, len, runs);
+
+	for (i = 0; i < 3; i++) {
+		const char *name[] = { "old", "stream", "queued" };
+		double best = 0;
+		double start;
+
+		for (run = 0; run < runs; run++) {
+			allocations = 0;
+			start = monotonic_time();
+			if (i == 0)
+				printed[i] = parse_old(out, data, len);
+			else
+				printed[i] = parse_stream(&session, out, data,
+							  len, i == 2 ?
+							  &queue : NULL);
+			output_flush(out);
+			elapsed = monotonic_time() - start;
+			if (!run || elapsed < best) {
+				best = elapsed;
+				allocs = allocations;
+			}
+		}
+		report(name[i], count, printed[i], allocs, best);
+	}
+
+	if (printed[0] != (unsigned long)count ||
+	    printed[1] != (unsigned long)count ||
+	    printed[2] != (unsigned long)count) {
+		fprintf(stderr, "printed %lu, %lu and %lu of %d statuses\n",
+			printed[0], printed[1], printed[2], count);
+		retval = 1;
+	}
+
+	name_table_free(names);
+	output_free(out);
+	free(data);
+	return retval;
+}
@@ -0,0 +1,209 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Startup benchmark for bti.
+ *
+ * Every mode that does not need a server is run RUNS times, from the
+ * fork() to the exit of the process we started, and the fastest, median
+ * and mean times are printed next to those of /bin/true.  All runs share
+ * a scratch home directory with a config file, so nothing of the user is
+ * read.  The bash mode submits to a btid that is started in that home
+ * directory, which is what the shell hook does on every prompt.  The
+ * host in the config does not listen, so whatever btid tries to post
+ * fails right away.
+ *
+ *	bench-startup [BTI [RUNS]]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct mode {
+	const char *name;
+	const char *args[8];
+	const char *input;
+	const char *program;	/* instead of bti */
+};
+
+static const struct mode modes[] = {
+	/* what any fork() and exec() costs here, for comparison */
+	{ "exec true", { }, NULL, "/bin/true" },
+	{ "help", { "--help" } },
+	{ "version", { "--version" } },
+	{ "dry-run update", { "--dry-run", "--action", "update", "--bash" },
+	  "bench update\n" },
+	{ "dry-run friends", { "--dry-run", "--action", "friends" } },
+	{ "local-friends", { "--action", "local-friends" } },
+	{ "search", { "--action", "search", "--query", "build" } },
+	{ "bash to btid", { "--action", "update", "--bash" },
+	  "bench update\n" },
+};
+
+static char home[] = "/tmp/bti-startup-XXXXXX";
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Start bti with @args, stdin from @input and the output thrown away */
+static pid_t spawn(const char *bti, const char *const *args,
+		   const char *input)
+{
+	const char *argv[16];
+	char path[64];
+	pid_t pid;
+	int fd;
+	int i;
+
+	argv[0] = bti;
+	for (i = 0; args[i]; i++)
+		argv[i + 1] = args[i];
+	argv[i + 1] = NULL;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	snprintf(path, sizeof(path), "%s/input", home);
+	fd = open(input ? path : "/dev/null", O_RDONLY);
+	dup2(fd, STDIN_FILENO);
+	fd = open("/dev/null", O_WRONLY);
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	execv(bti, (char *const *)argv);
+	_exit(127);
+}
+
+static int run_mode(const char *bti, const struct mode *mode, int runs)
+{
+	double *times;
+	double total = 0;
+	double start;
+	FILE *file;
+	char path[64];
+	int status;
+	pid_t pid;
+	int i;
+
+	if (mode->input) {
+		snprintf(path, sizeof(path), "%s/input", home);
+		file = fopen(path, "w");
+		if (!file)
+			return -errno;
+		fputs(mode->input, file);
+		fclose(file);
+	}
+
+	times = malloc(runs * sizeof(*times));
+	if (!times)
+		return -ENOMEM;
+	for (i = 0; i < runs; i++) {
+		start = now();
+		pid = spawn(mode->program ? mode->program : bti, mode->args,
+			    mode->input);
+		if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+			free(times);
+			return -errno;
+		}
+		times[i] = now() - start;
+		total += times[i];
+		if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+			fprintf(stderr, "%s: bti did not run\n", mode->name);
+			free(times);
+			return -EINVAL;
+		}
+	}
+
+	qsort(times, runs, sizeof(*times), cmp_double);
+	printf("%-16s %9.3f %9.3f %9.3f ms\n", mode->name, times[0] * 1000,
+	       times[runs / 2] * 1000, total / runs * 1000);
+	free(times);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *const daemon_args[] = { "--daemon", NULL };
+	const char *bti = argc > 1 ? argv[1] : "./bti";
+	int runs = argc > 2 ? atoi(argv[2]) : 200;
+	char path[64];
+	FILE *config;
+	pid_t daemon;
+	int retval = 0;
+	int i;
+
+	if (runs < 1)
+		runs = 1;
+	if (!mkdtemp(home)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("HOME", home, 1);
+
+	snprintf(path, sizeof(path), "%s/.bti", home);
+	config = fopen(path, "w");
+	if (!config) {
+		perror(path);
+		return 1;
+	}
+	fprintf(config, "account=bench\npassword=bench\n"
+		"host=http://127.0.0.1:9\nstore=no\n");
+	fclose(config);
+
+	daemon = spawn(bti, daemon_args, NULL);
+	/* give btid a moment to bind its socket */
+	snprintf(path, sizeof(path), "%s/.bti.sock", home);
+	for (i = 0; i < 100 && access(path, F_OK); i++)
+		usleep(10000);
+
+	printf("%d runs of %s\n", runs, bti);
+	printf("%-16s %9s %9s %9s\n", "mode", "min", "median", "mean");
+	for (i = 0; i < (int)(sizeof(modes) / sizeof(*modes)); i++) {
+		if (run_mode(bti, &modes[i], runs)) {
+			retval = 1;
+			break;
+		}
+	}
+
+	kill(daemon, SIGTERM);
+	waitpid(daemon, NULL, 0);
+	snprintf(path, sizeof(path), "rm -rf %s", home);
+	if (system(path))
+		retval = 1;
+	return retval;
+}
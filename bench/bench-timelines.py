@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the
+# Free Software Foundation version 2 of the License.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+"""End to end benchmark of bti against a local mock server.
+
+For every timeline size a mock-server.py is started, and bti is run
+against it once for every action: the network timelines, the local
+store and search actions on what those stored, and a batch of updates.
+The friends timeline is also run with the --from and --grep filters,
+and what they saved over printing everything is reported.
+Each run gets a fresh home directory with a config file pointing at the
+mock server.  The wall time, cpu time and peak rss of every bti process
+and the statuses it printed per second are written as JSON to --report,
+and a short table goes to stdout.
+"""
+
+import argparse
+import json
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+TIMELINES = (
+    ("friends", []),
+    ("public", []),
+    ("replies", []),
+    ("user", ["--user", "user1"]),
+    ("local-friends", ["--pages", "1-1000000000"]),
+    ("search", ["--query", "build", "--pages", "1-1000000000"]),
+)
+
+# the mock server has 97 authors, so --from lets 2 out of 97 through
+FILTERS = (
+    ("from", ["--from", "user1,user2"]),
+    ("grep", ["--grep", "ticket"]),
+    ("grep-regex", ["--grep", "ticket (for|&)"]),
+)
+
+
+def start_server(args, statuses):
+    command = [sys.executable, os.path.join(HERE, "mock-server.py"),
+               "--statuses", str(statuses), "--chunk", str(args.chunk),
+               "--latency", str(args.latency)]
+    if args.cert:
+        command += ["--cert", args.cert]
+    server = subprocess.Popen(command, stdout=subprocess.PIPE,
+                              universal_newlines=True)
+    port = int(server.stdout.readline())
+    return server, "%s://localhost:%d" % ("https" if args.cert else "http",
+                                          port)
+
+
+def run_bti(args, home, options, stdin=None):
+    """Run bti once, returns its output line count and resource use."""
+    env = dict(os.environ, HOME=home)
+    start = time.monotonic()
+    bti = subprocess.Popen([args.bti, "--format", "tsv"] + options,
+                           env=env, stdin=subprocess.PIPE if stdin else
+                           subprocess.DEVNULL, stdout=subprocess.PIPE,
+                           stderr=subprocess.DEVNULL)
+    if stdin:
+        bti.stdin.write(stdin.encode())
+        bti.stdin.close()
+    lines = 0
+    while True:
+        data = bti.stdout.read(1 << 20)
+        if not data:
+            break
+        lines += data.count(b"\n")
+    _, status, usage = os.wait4(bti.pid, 0)
+    wall = time.monotonic() - start
+    if os.WIFEXITED(status):
+        bti.returncode = os.WEXITSTATUS(status)
+    else:
+        bti.returncode = -os.WTERMSIG(status)
+    return lines, bti.returncode, wall, usage
+
+
+def record(results, action, statuses, lines, code, wall, usage):
+    cpu = usage.ru_utime + usage.ru_stime
+    result = {
+        "action": action,
+        "statuses": statuses,
+        "printed": lines,
+        "exit_code": code,
+        "wall_s": round(wall, 6),
+        "user_s": round(usage.ru_utime, 6),
+        "sys_s": round(usage.ru_stime, 6),
+        "cpu_s": round(cpu, 6),
+        "max_rss_kb": usage.ru_maxrss,
+        "statuses_per_s": round(lines / wall, 1) if wall > 0 else 0,
+    }
+    results.append(result)
+    print("%-14s %9d %9d %9.3f %9.3f %9d %12.1f" % (
+        action, statuses, lines, wall, cpu, usage.ru_maxrss,
+        result["statuses_per_s"]), flush=True)
+    return result
+
+
+def bench_size(args, statuses, results):
+    server, url = start_server(args, statuses)
+    home = tempfile.mkdtemp(prefix="bti-bench-")
+    try:
+        with open(os.path.join(home, ".bti"), "w") as config:
+            config.write("account=bench\npassword=bench\nhost=%s\n" % url)
+
+        for action, options in TIMELINES:
+            lines, code, wall, usage = run_bti(
+                args, home, ["--action", action] + options)
+            result = record(results, action, statuses, lines, code, wall,
+                            usage)
+            if action == "friends":
+                friends = result
+
+        for name, options in FILTERS:
+            lines, code, wall, usage = run_bti(
+                args, home, ["--action", "friends"] + options)
+            result = record(results, name, statuses, lines, code, wall,
+                            usage)
+            result["cpu_saved_s"] = round(friends["cpu_s"] -
+                                          result["cpu_s"], 6)
+
+        # updates are a batch on one connection, one per line of stdin
+        updates = min(statuses, args.max_updates)
+        lines, code, wall, usage = run_bti(
+            args, home, ["--batch", "-"],
+            "".join("bench update %d\n" % i for i in range(updates)))
+        # the batch prints one line per update and a summary
+        record(results, "update", updates, max(lines - 1, 0), code, wall,
+               usage)
+    finally:
+        server.terminate()
+        server.wait()
+        shutil.rmtree(home, ignore_errors=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--bti", default="./bti", help="bti binary to run")
+    parser.add_argument("--report", default="bench-report.json",
+                        help="where to write the JSON report")
+    parser.add_argument("--sizes", default="10,1000,100000",
+                        help="comma separated timeline sizes, "
+                        "up to 1000000")
+    parser.add_argument("--chunk", type=int, default=16384,
+                        help="bytes per chunk the server sends")
+    parser.add_argument("--latency", type=float, default=0,
+                        help="server latency per response in ms")
+    parser.add_argument("--max-updates", type=int, default=200,
+                        help="updates to send at most per size")
+    parser.add_argument("--cert", help="PEM certificate and key, to "
+                        "benchmark against an https server")
+    args = parser.parse_args()
+
+    sizes = [int(size) for size in args.sizes.split(",") if size]
+    results = []
+
+    print("%-14s %9s %9s %9s %9s %9s %12s" % (
+        "action", "statuses", "printed", "wall s", "cpu s", "rss kb",
+        "statuses/s"))
+    for statuses in sizes:
+        bench_size(args, statuses, results)
+
+    report = {
+        "bti": os.path.abspath(args.bti),
+        "time": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "machine": platform.machine(),
+        "python": platform.python_version(),
+        "chunk": args.chunk,
+        "latency_ms": args.latency,
+        "https": bool(args.cert),
+        "results": results,
+    }
+    with open(args.report, "w") as out:
+        json.dump(report, out, indent=1)
+        out.write("\n")
+    print("report written to %s" % args.report)
+
+    failed = [r for r in results if r["exit_code"] or
+              r["printed"] < min(r["statuses"], 1)]
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
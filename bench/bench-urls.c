@@ -0,0 +1,285 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Microbenchmark for the url matchers of bti.
+ *
+ * bti is a single file, so it is pulled in whole with its main() renamed
+ * and the static functions are called directly.  The matchers are run
+ * over a generated corpus of messages: the way find_urls() used to work
+ * (compile the regex per message, strlen() on every match), the
+ * precompiled pcre matcher and the builtin scanner, and the throughput
+ * of each is printed.
+ *
+ * Before that the pcre matcher and the builtin scanner are run over
+ * random strings made of every character of the classes of re_magic and
+ * a few that are in none of them, and the benchmark fails if they ever
+ * disagree on a single range.
+ *
+ *	bench-urls [MESSAGES [RANDOM_STRINGS]]
+ */
+
+#define main bti_main
+#include "../bti.c"
+#undef main
+
+static const char *words[] = {
+	"the", "build", "is", "broken", "again", "see", "ticket", "for",
+	"details", "deploying", "now", "dashboard", "looks", "fine", "to",
+	"me", "ping", "@gregkh", "#bti", "email:", "a:b", "x/y", "ok?",
+};
+
+static const char *urls[] = {
+	"http://example.com/",
+	"https://build.example.org/job/bti/1234/console",
+	"http://dashboard.example.net/graphs?host=web1&period=1d",
+	"ftp://ftp.example.com/pub/bti-023.tar.gz",
+	"http://example.com/wiki/Page_(disambiguation)#History",
+	"svn+ssh://svn.example.org/repo/trunk",
+};
+
+static unsigned int seed = 1;
+
+static unsigned int bench_rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+static char **make_corpus(int count, size_t *bytes)
+{
+	char **corpus;
+	char buffer[512];
+	int len;
+	int i;
+
+	corpus = malloc(count * sizeof(*corpus));
+	*bytes = 0;
+	for (i = 0; i < count; i++) {
+		len = 0;
+		while (len < 120) {
+			const char *word;
+
+			if (bench_rand() % 8 == 0)
+				word = urls[bench_rand() %
+					    (sizeof(urls) / sizeof(*urls))];
+			else
+				word = words[bench_rand() %
+					     (sizeof(words) / sizeof(*words))];
+			len += snprintf(buffer + len, sizeof(buffer) - len,
+					"%s ", word);
+		}
+		corpus[i] = strdup(buffer);
+		*bytes += len;
+	}
+	return corpus;
+}
+
+/* find_urls() as it was before the matcher was kept around */
+static int find_urls_old(const char *tweet, int **pranges)
+{
+	pcre *re;
+	const char *errptr;
+	int erroffset;
+	int ovector[10] = {0,};
+	const size_t ovsize = sizeof(ovector)/sizeof(*ovector);
+	int startoffset, tweetlen;
+	int i, rc;
+	int rbound = 10;
+	int rcount = 0;
+	int *ranges = malloc(sizeof(int) * rbound);
+
+	re = pcre_compile(re_magic,
+			PCRE_NO_AUTO_CAPTURE,
+			&errptr, &erroffset, NULL);
+	if (!re) {
+		fprintf(stderr, "pcre_compile @%u: %s\n", erroffset, errptr);
+		exit(1);
+	}
+
+	tweetlen = strlen(tweet);
+	for (startoffset = 0; startoffset < tweetlen; ) {
+
+		rc = pcre_exec(re, NULL, tweet, strlen(tweet), startoffset, 0,
+				ovector, ovsize);
+		if (rc == PCRE_ERROR_NOMATCH)
+			break;
+
+		for (i = 0; i < rc; i += 2) {
+			if ((rcount+2) == rbound) {
+				rbound *= 2;
+				ranges = realloc(ranges, sizeof(int) * rbound);
+			}
+
+			ranges[rcount++] = ovector[i];
+			ranges[rcount++] = ovector[i+1];
+		}
+
+		startoffset = ovector[1];
+	}
+
+	pcre_free(re);
+
+	*pranges = ranges;
+	return rcount;
+}
+
+/* Characters that are in no class of re_magic, or only matter around one */
+static const char outside[] = "# \t\n\"<>[]{}|\\^`,\xc3\xa9";
+
+/*
+ * Every character of every bracket class of re_magic, so that each entry
+ * of the scanner's class table is tried, followed by @outside.
+ */
+static int make_alphabet(char *alphabet)
+{
+	char seen[256] = { };
+	const char *p = re_magic;
+	int len = 0;
+	int from;
+	int to;
+	int c;
+
+	while ((p = strchr(p, '['))) {
+		for (p++; *p != ']'; p++) {
+			if (*p == '\\')
+				p++;
+			from = to = (unsigned char)*p;
+			if (p[1] == '-' && p[2] != ']') {
+				to = (unsigned char)p[2];
+				p += 2;
+			}
+			for (c = from; c <= to; c++)
+				seen[c] = 1;
+		}
+	}
+	for (c = 1; c < 256; c++)
+		if (seen[c])
+			alphabet[len++] = c;
+	for (p = outside; *p; p++)
+		if (!seen[(unsigned char)*p])
+			alphabet[len++] = *p;
+	return len;
+}
+
+/* Check that the scanner finds exactly what the regex finds */
+static int differential(int count)
+{
+	char alphabet[256];
+	char buffer[256];
+	int size;
+	int *ranges_pcre;
+	int *ranges_scan;
+	int rc_pcre;
+	int rc_scan;
+	int len;
+	int i;
+	int j;
+
+	size = make_alphabet(alphabet);
+	for (i = 0; i < count; i++) {
+		len = bench_rand() % sizeof(buffer);
+		for (j = 0; j < len; j++) {
+			/* sprinkle in real schemes to get longer urls */
+			if (bench_rand() % 32 == 0 && j + 7 < len) {
+				memcpy(buffer + j, "http://", 7);
+				j += 6;
+				continue;
+			}
+			buffer[j] = alphabet[bench_rand() % size];
+		}
+
+		rc_pcre = find_urls_pcre(buffer, len, &ranges_pcre);
+		rc_scan = find_urls_scan(buffer, len, &ranges_scan);
+		if (rc_pcre != rc_scan ||
+		    memcmp(ranges_pcre, ranges_scan, rc_pcre * sizeof(int))) {
+			fprintf(stderr, "matchers disagree on \"%.*s\"\n",
+				len, buffer);
+			for (j = 0; j < rc_pcre; j += 2)
+				fprintf(stderr, "  pcre:    %d-%d\n",
+					ranges_pcre[j], ranges_pcre[j + 1]);
+			for (j = 0; j < rc_scan; j += 2)
+				fprintf(stderr, "  builtin: %d-%d\n",
+					ranges_scan[j], ranges_scan[j + 1]);
+			return 1;
+		}
+		free(ranges_pcre);
+		free(ranges_scan);
+	}
+	printf("pcre and builtin agree on %d random strings of %d "
+	       "characters\n", count, size);
+	return 0;
+}
+
+static void report(const char *name, int count, size_t bytes,
+		   unsigned long found, double elapsed)
+{
+	printf("%-10s %8d msgs %8lu urls %8.3f s %10.0f msgs/s %8.2f MB/s\n",
+	       name, count, found, elapsed, count / elapsed,
+	       bytes / elapsed / (1024 * 1024));
+}
+
+int main(int argc, char *argv[])
+{
+	int count = argc > 1 ? atoi(argv[1]) : 100000;
+	int random_count = argc > 2 ? atoi(argv[2]) : 200000;
+	unsigned long found_old = 0;
+	unsigned long found_new = 0;
+	unsigned long found_scan = 0;
+	char **corpus;
+	size_t bytes;
+	double start;
+	int *ranges;
+	int i;
+
+	if (differential(random_count))
+		return 1;
+
+	corpus = make_corpus(count, &bytes);
+
+	start = monotonic_time();
+	for (i = 0; i < count; i++) {
+		found_old += find_urls_old(corpus[i], &ranges) / 2;
+		free(ranges);
+	}
+	report("old", count, bytes, found_old, monotonic_time() - start);
+
+	start = monotonic_time();
+	for (i = 0; i < count; i++) {
+		found_new += find_urls(corpus[i], strlen(corpus[i]),
+				       &ranges) / 2;
+		free(ranges);
+	}
+	report("pcre", count, bytes, found_new, monotonic_time() - start);
+
+	start = monotonic_time();
+	for (i = 0; i < count; i++) {
+		found_scan += find_urls_scan(corpus[i], strlen(corpus[i]),
+					     &ranges) / 2;
+		free(ranges);
+	}
+	report("builtin", count, bytes, found_scan, monotonic_time() - start);
+
+	if (found_old != found_new || found_old != found_scan) {
+		fprintf(stderr, "url counts differ: %lu, %lu, %lu\n",
+			found_old, found_new, found_scan);
+		return 1;
+	}
+
+	for (i = 0; i < count; i++)
+		free(corpus[i]);
+	free(corpus);
+	return 0;
+}
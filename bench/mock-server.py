@@ -0,0 +1,199 @@
+#!/usr/bin/env python3
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the
+# Free Software Foundation version 2 of the License.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+"""Local stand-in for the identi.ca / twitter statuses API.
+
+Every timeline (friends_timeline.xml, public_timeline.xml, replies.xml
+and user_timeline/NAME.xml) answers with the same synthetic timeline of
+--statuses statuses, newest first, honouring since_id.  The document is
+generated as it is sent, in chunks of --chunk bytes with chunked transfer
+encoding, so a timeline of a million statuses does not have to fit in
+memory.  --latency delays the first byte of every response.  Posts to
+update.xml are read and answered with a small status.
+
+The port that was bound is printed on the first line of stdout, so use
+--port 0 to let the kernel pick a free one.  With --cert, a PEM file with
+a certificate and its key, the server speaks https instead of http.
+"""
+
+import argparse
+import http.server
+import socketserver
+import ssl
+import sys
+import time
+import urllib.parse
+
+WORDS = ("the build is broken again see ticket for details deploying now "
+         "dashboard looks fine to me ping @gregkh #bti & <ok> "
+         "http://example.com/x?a=1&b=2").split()
+
+STATUS = ("<status>\n"
+          "  <created_at>%s</created_at>\n"
+          "  <id>%d</id>\n"
+          "  <text>%s</text>\n"
+          "  <source>web</source>\n"
+          "  <truncated>false</truncated>\n"
+          "  <in_reply_to_status_id></in_reply_to_status_id>\n"
+          "  <user>\n"
+          "    <id>%d</id>\n"
+          "    <name>Bench User %d</name>\n"
+          "    <screen_name>user%d</screen_name>\n"
+          "    <location>here</location>\n"
+          "    <followers_count>%d</followers_count>\n"
+          "  </user>\n"
+          "</status>\n")
+
+HEAD = ('<?xml version="1.0" encoding="UTF-8"?>\n'
+        '<statuses type="array">\n')
+TAIL = '</statuses>\n'
+
+DAYS = ("Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun")
+MONTHS = ("Jan", "Feb", "Mar", "Apr", "May", "Jun",
+          "Jul", "Aug", "Sep", "Oct", "Nov", "Dec")
+
+# the newest status has this id, the older ones count down from it
+TOP_ID = 5000000000
+
+
+def escape(text):
+    return (text.replace("&", "&amp;").replace("<", "&lt;")
+            .replace(">", "&gt;"))
+
+
+def status(n):
+    """The n-th newest status of the timeline."""
+    when = time.gmtime(1220000000 - n * 37)
+    created = "%s %s %02d %02d:%02d:%02d +0000 %d" % (
+        DAYS[when.tm_wday], MONTHS[when.tm_mon - 1], when.tm_mday,
+        when.tm_hour, when.tm_min, when.tm_sec, when.tm_year)
+    words = [WORDS[(n * 7 + i * 13) % len(WORDS)]
+             for i in range(8 + n % 12)]
+    user = n % 97
+    return STATUS % (created, TOP_ID - n, escape(" ".join(words)),
+                     1000 + user, user, user, n % 5000)
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    # headers and body are separate writes, do not let them wait on acks
+    disable_nagle_algorithm = True
+
+    def log_message(self, format, *args):
+        if self.server.verbose:
+            sys.stderr.write("mock-server: " + format % args + "\n")
+
+    def delay(self):
+        if self.server.latency:
+            time.sleep(self.server.latency)
+
+    def send_chunk(self, data):
+        data = data.encode()
+        self.wfile.write(b"%x\r\n%s\r\n" % (len(data), data))
+
+    def do_GET(self):
+        url = urllib.parse.urlparse(self.path)
+        path = url.path.rstrip("/")
+        if not (path.endswith("/friends_timeline.xml") or
+                path.endswith("/public_timeline.xml") or
+                path.endswith("/replies.xml") or
+                "/user_timeline/" in path):
+            self.send_error(404)
+            return
+
+        query = urllib.parse.parse_qs(url.query)
+        since = int(query.get("since_id", ["0"])[0])
+        count = self.server.statuses
+        if since:
+            count = min(count, max(TOP_ID - since, 0))
+
+        self.delay()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/xml; charset=utf-8")
+        self.send_header("Transfer-Encoding", "chunked")
+        self.end_headers()
+
+        chunk = [HEAD]
+        size = len(HEAD)
+        for n in range(count):
+            text = status(n)
+            chunk.append(text)
+            size += len(text)
+            if size >= self.server.chunk:
+                self.send_chunk("".join(chunk))
+                chunk = []
+                size = 0
+        chunk.append(TAIL)
+        self.send_chunk("".join(chunk))
+        self.wfile.write(b"0\r\n\r\n")
+
+    def do_POST(self):
+        length = int(self.headers.get("Content-Length", 0))
+        self.rfile.read(length)
+        if not urllib.parse.urlparse(self.path).path.endswith("/update.xml"):
+            self.send_error(404)
+            return
+
+        self.server.updates += 1
+        body = ('<?xml version="1.0" encoding="UTF-8"?>\n' +
+                status(0).replace("<id>%d</id>" % TOP_ID,
+                                  "<id>%d</id>" %
+                                  (TOP_ID + self.server.updates))).encode()
+        self.delay()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/xml; charset=utf-8")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--port", type=int, default=0)
+    parser.add_argument("--statuses", type=int, default=20,
+                        help="statuses in every timeline")
+    parser.add_argument("--chunk", type=int, default=16384,
+                        help="bytes per chunk of a timeline")
+    parser.add_argument("--latency", type=float, default=0,
+                        help="milliseconds before every response")
+    parser.add_argument("--cert", help="serve https with this PEM file")
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    server = Server(("127.0.0.1", args.port), Handler)
+    if args.cert:
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(args.cert)
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+    server.statuses = args.statuses
+    server.chunk = max(args.chunk, 1)
+    server.latency = args.latency / 1000.0
+    server.verbose = args.verbose
+    server.updates = 0
+
+    print(server.server_address[1], flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
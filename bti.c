@@ -29,9 +29,19 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <signal.h>
+#include <libgen.h>
 #include <curl/curl.h>
 #include <readline/readline.h>
 #include <libxml/xmlmemory.h>
@@ -42,6 +52,9 @@
 
 #define zalloc(size)	calloc(size, 1)
 
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
 #define dbg(format, arg...)						\
 	do {								\
 		if (debug)						\
@@ -53,6 +66,13 @@
 static int debug;
 static int verbose;
 
+enum url_scanner {
+	URL_SCANNER_PCRE    = 0,
+	URL_SCANNER_BUILTIN = 1
+};
+
+static enum url_scanner url_scanner;
+
 enum host {
 	HOST_TWITTER  = 0,
 	HOST_IDENTICA = 1,
@@ -65,7 +85,78 @@ enum action {
 	ACTION_USER    = 2,
 	ACTION_REPLIES = 4,
 	ACTION_PUBLIC  = 8,
-	ACTION_UNKNOWN = 16
+	ACTION_UNKNOWN = 16,
+	ACTION_SEARCH  = 32
+};
+
+enum output_format {
+	OUTPUT_HUMAN = 0,
+	OUTPUT_JSON,
+	OUTPUT_TSV,
+	OUTPUT_NUL
+};
+
+/*
+ * Receive buffer for response bodies.  It grows geometrically, refuses
+ * to grow past max_size and is kept in the session so that consecutive
+ * requests in one process reuse the same allocation.  The counters are
+ * cumulative over the lifetime of the buffer.
+ */
+struct bti_curl_buffer {
+	char *data;
+	enum action action;
+	size_t length;
+	size_t size;
+	size_t max_size;
+	int overflow;
+	struct timeline_parser *parser;
+	unsigned long long bytes_received;
+	unsigned long long bytes_copied;
+	size_t peak_size;
+	char *etag;
+	char *last_modified;
+};
+
+/*
+ * A host/account pair that updates are sent to.  Once any are
+ * configured they take the place of the session's host, unless --host
+ * was given.
+ */
+struct target {
+	enum host host;
+	char *hosturl;
+	char *account;
+	char *password;
+	CURL *curl;
+};
+
+/*
+ * Where the time of a run went, for --stats.  The network phases come
+ * from curl and are summed over every transfer, so with concurrent
+ * transfers they can add up to more than the wall clock.
+ */
+struct run_stats {
+	double start;
+	double config;
+	double shrink;
+	double dns;
+	double connect;
+	double tls;
+	double server;
+	double transfer;
+	double parse;
+	int transfers;
+	unsigned long long bytes;	/* sent and received */
+};
+
+/* The --from and --grep predicates on the statuses of a timeline */
+struct status_filter {
+	char **from;
+	int nfrom;
+	char *grep;
+	int literal;	/* nothing in grep that pcre treats specially */
+	pcre *re;
+	pcre_extra *extra;
 };
 
 struct session {
@@ -73,23 +164,66 @@ struct session {
 	char *account;
 	char *tweet;
 	char *proxy;
-	char *time;
 	char *homedir;
 	char *logfile;
+	off_t log_max_size;
+	struct log_writer *log;
 	char *user;
 	char *hosturl;
+	char *actions;	/* a list of timelines to merge */
 	int bash;
+	int daemon;
+	char *batch;
+	int batch_delim;
+	double rate;
 	int shrink_urls;
+	char *shrinker;
+	double shrink_timeout;
+	int url_cache_enabled;
+	time_t url_cache_ttl;
+	struct url_cache *url_cache;
+	int net_cache_enabled;
+	time_t net_cache_ttl;
+	CURLSH *share;
+	struct curl_slist *resolve;
+	struct curl_slist **stale_resolve;
+	int nstale_resolve;
+	struct curl_slist *unresolve;
+	int store_enabled;
+	int local;
+	char *query;
+	time_t since;
+	time_t until;
+	struct status_filter filter;
+	struct status_store *store;
 	int dry_run;
 	int page;
+	int last_page;
+	int incremental;
+	unsigned long long since_id;
+	unsigned long long max_id;
+	unsigned long long wire_bytes;
+	unsigned long long body_bytes;
+	int requests;
+	int conditional;
+	int not_modified;
+	unsigned long statuses;
+	enum output_format format;
+	struct output *output;
+	int follow;
+	double follow_min;
+	double follow_max;
+	int stats;
+	struct run_stats times;
+	int jobs;
+	size_t max_body;
 	enum host host;
 	enum action action;
-};
-
-struct bti_curl_buffer {
-	char *data;
-	enum action action;
-	int length;
+	struct bti_curl_buffer *curl_buf;
+	CURL *curl;
+	struct target *targets;
+	int ntargets;
+	int host_override;
 };
 
 static void display_help(void)
@@ -102,15 +236,37 @@ static void display_help(void)
 	fprintf(stdout, "  --account accountname\n");
 	fprintf(stdout, "  --password password\n");
 	fprintf(stdout, "  --action action\n");
-	fprintf(stdout, "    ('update', 'friends', 'public', 'replies' "
-		"or 'user')\n");
-	fprintf(stdout, "  --user screenname\n");
+	fprintf(stdout, "    ('update', 'friends', 'public', 'replies', "
+		"'user' or 'search',\n");
+	fprintf(stdout, "     or 'local-friends', 'local-public', "
+		"'local-replies' or 'local-user',\n");
+	fprintf(stdout, "     or a list like 'friends,replies,user' "
+		"to merge)\n");
+	fprintf(stdout, "  --query QUERY\n");
+	fprintf(stdout, "  --format FORMAT\n");
+	fprintf(stdout, "    ('human', 'json', 'tsv' or 'nul')\n");
+	fprintf(stdout, "  --follow\n");
+	fprintf(stdout, "  --follow-interval MIN[-MAX]\n");
+	fprintf(stdout, "  --since TIME\n");
+	fprintf(stdout, "  --until TIME\n");
+	fprintf(stdout, "  --from screenname[,screenname...]\n");
+	fprintf(stdout, "  --grep PATTERN\n");
+	fprintf(stdout, "  --user screenname[,screenname...]\n");
 	fprintf(stdout, "  --proxy PROXY:PORT\n");
 	fprintf(stdout, "  --host HOST\n");
 	fprintf(stdout, "  --logfile logfile\n");
 	fprintf(stdout, "  --shrink-urls\n");
 	fprintf(stdout, "  --page PAGENUMBER\n");
+	fprintf(stdout, "  --pages FIRST-LAST\n");
+	fprintf(stdout, "  --jobs COUNT\n");
+	fprintf(stdout, "  --max-body SIZE\n");
+	fprintf(stdout, "  --incremental\n");
+	fprintf(stdout, "  --stats\n");
 	fprintf(stdout, "  --bash\n");
+	fprintf(stdout, "  --daemon\n");
+	fprintf(stdout, "  --batch FILE\n");
+	fprintf(stdout, "  --null\n");
+	fprintf(stdout, "  --rate UPDATES_PER_SECOND\n");
 	fprintf(stdout, "  --debug\n");
 	fprintf(stdout, "  --verbose\n");
 	fprintf(stdout, "  --dry-run\n");
@@ -123,49 +279,53 @@ static void display_version(void)
 	fprintf(stdout, "bti - version %s\n", VERSION);
 }
 
-static struct session *session_alloc(void)
+/* Seconds on a clock that does not jump around with the wall clock */
+static double monotonic_time(void)
 {
-	struct session *session;
+	struct timespec ts;
 
-	session = zalloc(sizeof(*session));
-	if (!session)
-		return NULL;
-	return session;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-static void session_free(struct session *session)
+static void sleep_for(double seconds)
 {
-	if (!session)
-		return;
-	free(session->password);
-	free(session->account);
-	free(session->tweet);
-	free(session->proxy);
-	free(session->time);
-	free(session->homedir);
-	free(session->user);
-	free(session->hosturl);
-	free(session);
+	struct timespec ts;
+
+	ts.tv_sec = seconds;
+	ts.tv_nsec = (seconds - ts.tv_sec) * 1e9;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
 }
 
-static struct bti_curl_buffer *bti_curl_buffer_alloc(enum action action)
+/* default limit for a response body, 0 means unlimited */
+#define BTI_MAX_BODY	(16 * 1024 * 1024)
+
+static struct bti_curl_buffer *bti_curl_buffer_alloc(size_t max_size)
 {
 	struct bti_curl_buffer *buffer;
 
 	buffer = zalloc(sizeof(*buffer));
 	if (!buffer)
 		return NULL;
+	buffer->max_size = max_size;
+	return buffer;
+}
 
-	/* start out with a data buffer of 1 byte to
-	 * make the buffer fill logic simpler */
-	buffer->data = zalloc(1);
-	if (!buffer->data) {
-		free(buffer);
-		return NULL;
-	}
+/* Get the buffer ready for the next request, keeping its memory */
+static void bti_curl_buffer_reset(struct bti_curl_buffer *buffer,
+				  enum action action)
+{
 	buffer->length = 0;
+	buffer->overflow = 0;
 	buffer->action = action;
-	return buffer;
+	buffer->parser = NULL;
+	if (buffer->data)
+		buffer->data[0] = '\0';
+	free(buffer->etag);
+	free(buffer->last_modified);
+	buffer->etag = NULL;
+	buffer->last_modified = NULL;
 }
 
 static void bti_curl_buffer_free(struct bti_curl_buffer *buffer)
@@ -173,730 +333,6211 @@ static void bti_curl_buffer_free(struct bti_curl_buffer *buffer)
 	if (!buffer)
 		return;
 	free(buffer->data);
+	free(buffer->etag);
+	free(buffer->last_modified);
 	free(buffer);
 }
 
-static const char *twitter_host  = "https://twitter.com/statuses";
-static const char *identica_host = "https://identi.ca/api/statuses";
+static int bti_curl_buffer_append(struct bti_curl_buffer *buffer,
+				  const char *data, size_t len)
+{
+	size_t size;
+	char *temp;
 
-static const char *user_uri    = "/user_timeline/";
-static const char *update_uri  = "/update.xml";
-static const char *public_uri  = "/public_timeline.xml";
-static const char *friends_uri = "/friends_timeline.xml";
-static const char *replies_uri = "/replies.xml";
+	if (buffer->length + len + 1 > buffer->size) {
+		size = buffer->size ? buffer->size : 4096;
+		while (size < buffer->length + len + 1)
+			size *= 2;
+		temp = realloc(buffer->data, size);
+		if (!temp)
+			return -ENOMEM;
+		/* worst case realloc had to move what we already have */
+		buffer->bytes_copied += buffer->length;
+		buffer->data = temp;
+		buffer->size = size;
+		if (size > buffer->peak_size)
+			buffer->peak_size = size;
+	}
+
+	memcpy(&buffer->data[buffer->length], data, len);
+	buffer->bytes_copied += len;
+	buffer->length += len;
+	buffer->data[buffer->length] = '\0';
+	return 0;
+}
 
-static CURL *curl_init(void)
+static void bti_curl_buffer_stats(struct bti_curl_buffer *buffer, CURL *curl)
 {
-	CURL *curl;
+	curl_off_t wire = 0;
 
-	curl = curl_easy_init();
-	if (!curl) {
-		fprintf(stderr, "Can not init CURL!\n");
-		return NULL;
-	}
-	/* some ssl sanity checks on the connection we are making */
-	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
-	return curl;
+	/* the download size is counted before any content decoding */
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wire);
+	dbg("received %llu bytes (%lld on the wire), copied %llu bytes, "
+	    "peak buffer %zu bytes\n", buffer->bytes_received,
+	    (long long)wire, buffer->bytes_copied, buffer->peak_size);
 }
 
-static void parse_statuses(xmlDocPtr doc, xmlNodePtr current)
-{
-	xmlChar *text = NULL;
-	xmlChar *user = NULL;
-	xmlChar *created = NULL;
-	xmlNodePtr userinfo;
-
-	current = current->xmlChildrenNode;
-	while (current != NULL) {
-		if (current->type == XML_ELEMENT_NODE) {
-			if (!xmlStrcmp(current->name, (const xmlChar *)"created_at"))
-				created = xmlNodeListGetString(doc, current->xmlChildrenNode, 1);
-			if (!xmlStrcmp(current->name, (const xmlChar *)"text"))
-				text = xmlNodeListGetString(doc, current->xmlChildrenNode, 1);
-			if (!xmlStrcmp(current->name, (const xmlChar *)"user")) {
-				userinfo = current->xmlChildrenNode;
-				while (userinfo != NULL) {
-					if ((!xmlStrcmp(userinfo->name, (const xmlChar *)"screen_name"))) {
-						if (user)
-							xmlFree(user);
-						user = xmlNodeListGetString(doc, userinfo->xmlChildrenNode, 1);
-					}
-					userinfo = userinfo->next;
-				}
-			}
+/*
+ * Output of statuses.  Everything is formatted into one large buffer
+ * that is reused for the whole run and handed to writev() when it fills
+ * up, so piping a big timeline into another tool costs a write every
+ * OUTPUT_BUFFER_SIZE bytes instead of one per status.  An output with
+ * no file descriptor just collects what it is given, for pages that are
+ * waiting for their turn.
+ */
+#define OUTPUT_BUFFER_SIZE	(64 * 1024)
 
-			if (user && text && created) {
-				if (verbose)
-					printf("[%s] (%.16s) %s\n",
-						user, created, text);
-				else
-					printf("[%s] %s\n",
-						user, text);
-				xmlFree(user);
-				xmlFree(text);
-				xmlFree(created);
-				user = NULL;
-				text = NULL;
-				created = NULL;
-			}
+struct output {
+	int fd;			/* -1 keeps everything in memory */
+	enum output_format format;
+	char *data;
+	size_t length;
+	size_t size;
+	int error;
+	double write_time;	/* spent in writev(), for --stats */
+};
+
+static int output_writev(struct output *out, struct iovec *iov, int count)
+{
+	double start = monotonic_time();
+	ssize_t written;
+
+	while (count) {
+		written = writev(out->fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			out->error = -errno;
+			out->write_time += monotonic_time() - start;
+			return out->error;
+		}
+		while (count && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
 		}
-		current = current->next;
 	}
+	out->write_time += monotonic_time() - start;
+	return 0;
+}
 
-	return;
+static int output_flush(struct output *out)
+{
+	struct iovec iov;
+
+	if (!out || out->fd < 0 || !out->length)
+		return 0;
+	/* anything stdio still holds for the same file goes first */
+	if (out->fd == STDOUT_FILENO)
+		fflush(stdout);
+	iov.iov_base = out->data;
+	iov.iov_len = out->length;
+	out->length = 0;
+	return output_writev(out, &iov, 1);
 }
 
-static void parse_timeline(char *document)
+static struct output *output_alloc(int fd, enum output_format format)
 {
-	xmlDocPtr doc;
-	xmlNodePtr current;
+	struct output *out;
 
-	doc = xmlReadMemory(document, strlen(document), "timeline.xml",
-			    NULL, XML_PARSE_NOERROR);
-	if (doc == NULL)
-		return;
+	out = zalloc(sizeof(*out));
+	if (!out)
+		return NULL;
+	out->fd = fd;
+	out->format = format;
+	out->size = fd < 0 ? 4096 : OUTPUT_BUFFER_SIZE;
+	out->data = malloc(out->size);
+	if (!out->data) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
 
-	current = xmlDocGetRootElement(doc);
-	if (current == NULL) {
-		fprintf(stderr, "empty document\n");
-		xmlFreeDoc(doc);
+static void output_free(struct output *out)
+{
+	if (!out)
 		return;
+	output_flush(out);
+	free(out->data);
+	free(out);
+}
+
+/* Make room for @len more bytes in the buffer */
+static int output_reserve(struct output *out, size_t len)
+{
+	size_t size;
+	char *temp;
+
+	if (out->length + len <= out->size)
+		return 0;
+	if (out->fd >= 0) {
+		output_flush(out);
+		if (len <= out->size)
+			return 0;
+	}
+	size = out->size;
+	while (size < out->length + len)
+		size *= 2;
+	temp = realloc(out->data, size);
+	if (!temp) {
+		out->error = -ENOMEM;
+		return out->error;
 	}
+	out->data = temp;
+	out->size = size;
+	return 0;
+}
 
-	if (xmlStrcmp(current->name, (const xmlChar *) "statuses")) {
-		fprintf(stderr, "unexpected document type\n");
-		xmlFreeDoc(doc);
+static void output_append(struct output *out, const char *data, size_t len)
+{
+	struct iovec iov[2];
+
+	/* large pieces go out along with the buffer, without a copy */
+	if (out->fd >= 0 && len >= out->size / 2) {
+		if (out->fd == STDOUT_FILENO)
+			fflush(stdout);
+		iov[0].iov_base = out->data;
+		iov[0].iov_len = out->length;
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len = len;
+		out->length = 0;
+		output_writev(out, iov, 2);
 		return;
 	}
+	if (output_reserve(out, len))
+		return;
+	memcpy(out->data + out->length, data, len);
+	out->length += len;
+}
 
-	current = current->xmlChildrenNode;
-	while (current != NULL) {
-		if ((!xmlStrcmp(current->name, (const xmlChar *)"status")))
-			parse_statuses(doc, current);
-		current = current->next;
-	}
-	xmlFreeDoc(doc);
+static void output_string(struct output *out, const char *str)
+{
+	output_append(out, str, strlen(str));
+}
 
-	return;
+static void output_char(struct output *out, char c)
+{
+	if (out->length < out->size || !output_reserve(out, 1))
+		out->data[out->length++] = c;
 }
 
-static size_t curl_callback(void *buffer, size_t size, size_t nmemb,
-			    void *userp)
+/* A JSON string, with quotes, backslashes and control characters escaped */
+static void output_json(struct output *out, const char *str)
 {
-	struct bti_curl_buffer *curl_buf = userp;
-	size_t buffer_size = size * nmemb;
-	char *temp;
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *)str;
+	const unsigned char *run;
+	char escape[7];
+
+	output_char(out, '"');
+	while (*p) {
+		run = p;
+		while (*p >= 0x20 && *p != '"' && *p != '\\')
+			p++;
+		output_append(out, (const char *)run, p - run);
+		if (!*p)
+			break;
 
-	if ((!buffer) || (!buffer_size) || (!curl_buf))
-		return -EINVAL;
+		escape[0] = '\\';
+		escape[2] = '\0';
+		switch (*p) {
+		case '"':
+		case '\\':
+			escape[1] = *p;
+			break;
+		case '\n':
+			escape[1] = 'n';
+			break;
+		case '\r':
+			escape[1] = 'r';
+			break;
+		case '\t':
+			escape[1] = 't';
+			break;
+		case '\b':
+			escape[1] = 'b';
+			break;
+		case '\f':
+			escape[1] = 'f';
+			break;
+		default:
+			sprintf(escape, "\\u00%c%c", hex[*p >> 4],
+				hex[*p & 15]);
+			break;
+		}
+		output_string(out, escape);
+		p++;
+	}
+	output_char(out, '"');
+}
 
-	/* add to the data we already have */
-	temp = zalloc(curl_buf->length + buffer_size + 1);
-	if (!temp)
-		return -ENOMEM;
+/* A TSV field, with tabs, newlines and backslashes escaped */
+static void output_tsv(struct output *out, const char *str)
+{
+	const char *p = str;
+	const char *run;
+
+	while (*p) {
+		run = p;
+		p += strcspn(p, "\t\n\r\\");
+		output_append(out, run, p - run);
+		switch (*p) {
+		case '\0':
+			return;
+		case '\t':
+			output_string(out, "\\t");
+			break;
+		case '\n':
+			output_string(out, "\\n");
+			break;
+		case '\r':
+			output_string(out, "\\r");
+			break;
+		default:
+			output_string(out, "\\\\");
+			break;
+		}
+		p++;
+	}
+}
 
-	memcpy(temp, curl_buf->data, curl_buf->length);
-	free(curl_buf->data);
-	curl_buf->data = temp;
-	memcpy(&curl_buf->data[curl_buf->length], (char *)buffer, buffer_size);
-	curl_buf->length += buffer_size;
-	if (curl_buf->action)
-		parse_timeline(curl_buf->data);
+static void output_status(struct output *out, unsigned long long id,
+			  const char *created, const char *user,
+			  const char *text)
+{
+	char number[24];
+
+	snprintf(number, sizeof(number), "%llu", id);
+
+	switch (out->format) {
+	case OUTPUT_JSON:
+		output_string(out, "{\"id\":");
+		output_string(out, number);
+		output_string(out, ",\"created_at\":");
+		output_json(out, created);
+		output_string(out, ",\"user\":");
+		output_json(out, user);
+		output_string(out, ",\"text\":");
+		output_json(out, text);
+		output_string(out, "}\n");
+		break;
+	case OUTPUT_TSV:
+		output_string(out, number);
+		output_char(out, '\t');
+		output_tsv(out, created);
+		output_char(out, '\t');
+		output_tsv(out, user);
+		output_char(out, '\t');
+		output_tsv(out, text);
+		output_char(out, '\n');
+		break;
+	case OUTPUT_NUL:
+		/* only the text, which comes last, can hold a tab */
+		output_string(out, number);
+		output_char(out, '\t');
+		output_string(out, created);
+		output_char(out, '\t');
+		output_string(out, user);
+		output_char(out, '\t');
+		output_append(out, text, strlen(text) + 1);
+		break;
+	default:
+		output_char(out, '[');
+		output_string(out, user);
+		output_string(out, "] ");
+		if (verbose) {
+			output_char(out, '(');
+			output_append(out, created, strnlen(created, 16));
+			output_string(out, ") ");
+		}
+		output_string(out, text);
+		output_char(out, '\n');
+		break;
+	}
+}
 
-	dbg("%s\n", curl_buf->data);
+/*
+ * The log of what bti did, one JSON object per line.  The file is opened
+ * once with O_APPEND and records are collected in memory, then written
+ * with a single write() when the batch is large or old enough and when
+ * bti exits.  Only whole records are ever written, so several processes
+ * can share the file.  Once the file is larger than max_size it is
+ * renamed to FILE.1, replacing the one before, and a new file started.
+ */
+#define LOG_BATCH_SIZE		(16 * 1024)
+#define LOG_BATCH_AGE		1.0
+
+struct log_writer {
+	char *path;
+	int fd;
+	off_t max_size;
+	struct output *batch;
+	double oldest;		/* when the first record of the batch came */
+	unsigned long long bytes;	/* what has been logged already */
+	unsigned long statuses;
+};
 
-	return buffer_size;
+static int log_reopen(struct log_writer *log)
+{
+	log->fd = open(log->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		       0666);
+	return log->fd < 0 ? -errno : 0;
 }
 
-static int send_request(struct session *session)
+static struct log_writer *log_open(const char *path, off_t max_size)
 {
-	char endpoint[100];
-	char user_password[500];
-	char data[500];
-	struct bti_curl_buffer *curl_buf;
-	CURL *curl = NULL;
-	CURLcode res;
-	struct curl_httppost *formpost = NULL;
-	struct curl_httppost *lastptr = NULL;
-	struct curl_slist *slist = NULL;
-
-	if (!session)
-		return -EINVAL;
+	struct log_writer *log;
 
-	curl_buf = bti_curl_buffer_alloc(session->action);
-	if (!curl_buf)
-		return -ENOMEM;
+	log = zalloc(sizeof(*log));
+	if (!log)
+		return NULL;
+	log->path = strdup(path);
+	log->max_size = max_size;
+	log->batch = output_alloc(-1, OUTPUT_JSON);
+	if (!log->path || !log->batch || log_reopen(log)) {
+		output_free(log->batch);
+		free(log->path);
+		free(log);
+		return NULL;
+	}
+	return log;
+}
 
-	curl = curl_init();
-	if (!curl)
-		return -EINVAL;
+/*
+ * Move the full log out of the way.  The lock makes sure only one of the
+ * processes writing to it does, the others find a new file at the path
+ * and just open that.
+ */
+static void log_rotate(struct log_writer *log)
+{
+	struct stat st;
+	struct stat path_st;
+	char *rotated;
+	int fd = log->fd;
 
-	switch (session->action) {
-	case ACTION_UPDATE:
-		snprintf(user_password, sizeof(user_password), "%s:%s",
-			 session->account, session->password);
-		snprintf(data, sizeof(data), "status=\"%s\"", session->tweet);
-		curl_formadd(&formpost, &lastptr,
-			     CURLFORM_COPYNAME, "status",
-			     CURLFORM_COPYCONTENTS, session->tweet,
-			     CURLFORM_END);
+	if (flock(fd, LOCK_EX))
+		return;
+	if (!fstat(fd, &st) && !stat(log->path, &path_st) &&
+	    st.st_dev == path_st.st_dev && st.st_ino == path_st.st_ino) {
+		rotated = alloca(strlen(log->path) + 3);
+		sprintf(rotated, "%s.1", log->path);
+		if (rename(log->path, rotated))
+			dbg("cannot rotate %s: %s\n", log->path,
+			    strerror(errno));
+	}
+	flock(fd, LOCK_UN);
+	if (log_reopen(log))
+		log->fd = fd;
+	else
+		close(fd);
+}
 
-		curl_formadd(&formpost, &lastptr,
-			     CURLFORM_COPYNAME, "source",
-			     CURLFORM_COPYCONTENTS, "bti",
-			     CURLFORM_END);
+static void log_flush(struct log_writer *log)
+{
+	struct output *batch;
+	struct stat st;
+	size_t done = 0;
+	ssize_t written;
 
-		curl_easy_setopt(curl, CURLOPT_HTTPPOST, formpost);
-		slist = curl_slist_append(slist, "Expect:");
-		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
-		
-		sprintf(endpoint, "%s%s", session->hosturl, update_uri);
-		curl_easy_setopt(curl, CURLOPT_URL, endpoint);
-		curl_easy_setopt(curl, CURLOPT_USERPWD, user_password);
+	if (!log || !log->batch->length)
+		return;
+	batch = log->batch;
+	while (done < batch->length) {
+		written = write(log->fd, batch->data + done,
+				batch->length - done);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			dbg("cannot write %s: %s\n", log->path,
+			    strerror(errno));
+			break;
+		}
+		done += written;
+	}
+	batch->length = 0;
 
-		break;
-	case ACTION_FRIENDS:
-		snprintf(user_password, sizeof(user_password), "%s:%s",
-			 session->account, session->password);
-		sprintf(endpoint, "%s%s?page=%d", session->hosturl,
-			friends_uri, session->page);
-		curl_easy_setopt(curl, CURLOPT_URL, endpoint);
-		curl_easy_setopt(curl, CURLOPT_USERPWD, user_password);
+	if (log->max_size && !fstat(log->fd, &st) &&
+	    st.st_size >= log->max_size)
+		log_rotate(log);
+}
 
-		break;
-	case ACTION_USER:
-		sprintf(endpoint, "%s%s%s.xml?page=%d", session->hosturl, user_uri,
-				session->user, session->page);
-		curl_easy_setopt(curl, CURLOPT_URL, endpoint);
+static void log_close(struct log_writer *log)
+{
+	if (!log)
+		return;
+	log_flush(log);
+	close(log->fd);
+	output_free(log->batch);
+	free(log->path);
+	free(log);
+}
 
-		break;
-	case ACTION_REPLIES:
-		snprintf(user_password, sizeof(user_password), "%s:%s",
-			 session->account, session->password);
-		sprintf(endpoint, "%s%s?page=%d", session->hosturl, replies_uri, session->page);
-		curl_easy_setopt(curl, CURLOPT_URL, endpoint);
-		curl_easy_setopt(curl, CURLOPT_USERPWD, user_password);
+/*
+ * Persistent cache of shrunk urls, shared by every bti process of the
+ * user.  It is a fixed size open addressing hash table in a file that is
+ * mmap'd, so a lookup does not read or parse anything.  Writers take an
+ * exclusive flock() for the short time they touch the table.  Entries
+ * expire after ttl seconds, and when a probe sequence is full the least
+ * recently used entry in it is replaced.
+ */
+static const char *url_cache_file = ".bti_urlcache";
+
+#define URL_CACHE_MAGIC		"BTIURLC1"
+#define URL_CACHE_SLOTS		4096
+#define URL_CACHE_PROBES	16
+#define URL_CACHE_LONG		256
+#define URL_CACHE_SHORT		64
+
+struct url_cache_slot {
+	uint64_t hash;
+	uint64_t created;
+	uint64_t used;
+	char long_url[URL_CACHE_LONG];
+	char short_url[URL_CACHE_SHORT];
+};
 
-		break;
-	case ACTION_PUBLIC:
-		sprintf(endpoint, "%s%s?page=%d", session->hosturl, public_uri, session->page);
-		curl_easy_setopt(curl, CURLOPT_URL, endpoint);
+struct url_cache_header {
+	char magic[8];
+	uint32_t slots;
+	uint32_t pad;
+	uint64_t hits;
+	uint64_t misses;
+};
 
-		break;
-	default:
-		break;
-	}
+struct url_cache {
+	int fd;
+	size_t size;
+	struct url_cache_header *header;
+	struct url_cache_slot *slots;
+	time_t ttl;
+	unsigned long hits;
+	unsigned long misses;
+};
 
-	if (session->proxy)
-		curl_easy_setopt(curl, CURLOPT_PROXY, session->proxy);
+/* FNV-1a, good enough to spread urls over the table */
+static uint64_t hash_string(const char *str, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
 
-	if (debug)
-		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+	while (len--) {
+		hash ^= (unsigned char)*str++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
 
-	dbg("user_password = %s\n", user_password);
-	dbg("data = %s\n", data);
-	dbg("proxy = %s\n", session->proxy);
+static struct url_cache *url_cache_open(const char *homedir, time_t ttl)
+{
+	struct url_cache *cache;
+	struct stat st;
+	char *file;
+	void *map;
 
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_callback);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, curl_buf);
-	if (!session->dry_run) {
-		res = curl_easy_perform(curl);
-		if (res && !session->bash) {
-			fprintf(stderr, "error(%d) trying to perform "
-				"operation\n", res);
-			return -EINVAL;
-		}
+	cache = zalloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->ttl = ttl;
+	cache->size = sizeof(struct url_cache_header) +
+		      URL_CACHE_SLOTS * sizeof(struct url_cache_slot);
+
+	file = alloca(strlen(homedir) + strlen(url_cache_file) + 2);
+	sprintf(file, "%s/%s", homedir, url_cache_file);
+
+	cache->fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (cache->fd < 0)
+		goto error;
+
+	/* the first one in gets to lay out the table */
+	flock(cache->fd, LOCK_EX);
+	if (fstat(cache->fd, &st) < 0)
+		goto error_unlock;
+	if ((size_t)st.st_size != cache->size &&
+	    ftruncate(cache->fd, cache->size) < 0)
+		goto error_unlock;
+
+	map = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   cache->fd, 0);
+	if (map == MAP_FAILED)
+		goto error_unlock;
+	cache->header = map;
+	cache->slots = (struct url_cache_slot *)(cache->header + 1);
+
+	if (memcmp(cache->header->magic, URL_CACHE_MAGIC, 8) ||
+	    cache->header->slots != URL_CACHE_SLOTS) {
+		memset(map, 0, cache->size);
+		memcpy(cache->header->magic, URL_CACHE_MAGIC, 8);
+		cache->header->slots = URL_CACHE_SLOTS;
 	}
+	flock(cache->fd, LOCK_UN);
+	return cache;
+
+error_unlock:
+	flock(cache->fd, LOCK_UN);
+error:
+	if (cache->fd >= 0)
+		close(cache->fd);
+	free(cache);
+	return NULL;
+}
 
-	curl_easy_cleanup(curl);
-	if (session->action == ACTION_UPDATE)
-		curl_formfree(formpost);
-	bti_curl_buffer_free(curl_buf);
-	return 0;
+static void url_cache_close(struct url_cache *cache)
+{
+	if (!cache)
+		return;
+	if (verbose)
+		fprintf(stdout, "url cache: %lu hits, %lu misses "
+			"(%llu hits, %llu misses overall)\n",
+			cache->hits, cache->misses,
+			(unsigned long long)cache->header->hits,
+			(unsigned long long)cache->header->misses);
+	munmap(cache->header, cache->size);
+	close(cache->fd);
+	free(cache);
 }
 
-static void parse_configfile(struct session *session)
+static int url_cache_live(struct url_cache *cache,
+			  struct url_cache_slot *slot, time_t now)
 {
-	FILE *config_file;
-	char *line = NULL;
-	size_t len = 0;
-	char *account = NULL;
-	char *password = NULL;
-	char *host = NULL;
-	char *proxy = NULL;
-	char *logfile = NULL;
-	char *action = NULL;
-	char *user = NULL;
-	char *file;
-	int shrink_urls = 0;
+	return slot->hash && (!cache->ttl ||
+			      now - (time_t)slot->created < cache->ttl);
+}
 
-	/* config file is ~/.bti  */
-	file = alloca(strlen(session->homedir) + 7);
+/* Returns a copy of the short url for @url, or NULL if we do not know it */
+static char *url_cache_lookup(struct url_cache *cache, const char *url,
+			      size_t len)
+{
+	struct url_cache_slot *slot;
+	uint64_t hash = hash_string(url, len) | 1;
+	time_t now = time(NULL);
+	char *small = NULL;
+	int i;
 
-	sprintf(file, "%s/.bti", session->homedir);
-
-	config_file = fopen(file, "r");
-
-	/* No error if file does not exist or is unreadable.  */
-	if (config_file == NULL)
-		return;
+	if (len >= URL_CACHE_LONG)
+		return NULL;
 
-	do {
-		ssize_t n = getline(&line, &len, config_file);
-		if (n < 0)
+	flock(cache->fd, LOCK_EX);
+	for (i = 0; i < URL_CACHE_PROBES; i++) {
+		slot = &cache->slots[(hash + i) % URL_CACHE_SLOTS];
+		if (!slot->hash)
 			break;
-		if (line[n - 1] == '\n')
-			line[n - 1] = '\0';
-		/* Parse file.  Format is the usual value pairs:
-		   account=name
-		   passwort=value
-		   # is a comment character
-		*/
-		*strchrnul(line, '#') = '\0';
-		char *c = line;
-		while (isspace(*c))
-			c++;
-		/* Ignore blank lines.  */
-		if (c[0] == '\0')
+		if (slot->hash != hash || !url_cache_live(cache, slot, now) ||
+		    strncmp(slot->long_url, url, len) || slot->long_url[len])
 			continue;
+		slot->used = now;
+		small = strdup(slot->short_url);
+		break;
+	}
+	if (small) {
+		cache->hits++;
+		cache->header->hits++;
+	} else {
+		cache->misses++;
+		cache->header->misses++;
+	}
+	flock(cache->fd, LOCK_UN);
+	return small;
+}
 
-		if (!strncasecmp(c, "account", 7) && (c[7] == '=')) {
-			c += 8;
-			if (c[0] != '\0')
-				account = strdup(c);
-		} else if (!strncasecmp(c, "password", 8) &&
-			   (c[8] == '=')) {
-			c += 9;
-			if (c[0] != '\0')
-				password = strdup(c);
-		} else if (!strncasecmp(c, "host", 4) &&
-			   (c[4] == '=')) {
-			c += 5;
-			if (c[0] != '\0')
-				host = strdup(c);
-		} else if (!strncasecmp(c, "proxy", 5) &&
-			   (c[5] == '=')) {
-			c += 6;
-			if (c[0] != '\0')
-				proxy = strdup(c);
-		} else if (!strncasecmp(c, "logfile", 7) &&
-			   (c[7] == '=')) {
-			c += 8;
-			if (c[0] != '\0')
-				logfile = strdup(c);
-		} else if (!strncasecmp(c, "action", 6) &&
-			   (c[6] == '=')) {
-			c += 7;
-			if (c[0] != '\0')
-				action = strdup(c);
-		} else if (!strncasecmp(c, "user", 4) &&
-				(c[4] == '=')) {
-			c += 5;
-			if (c[0] != '\0')
-				user = strdup(c);
-		} else if (!strncasecmp(c, "shrink-urls", 11) &&
-				(c[11] == '=')) {
-			c += 12;
-			if (!strncasecmp(c, "true", 4) ||
-					!strncasecmp(c, "yes", 3))
-				shrink_urls = 1;
-		}
-		else if (!strncasecmp(c, "verbose", 7) &&
-				(c[7] == '=')) {
-			c += 8;
-			if (!strncasecmp(c, "true", 4) ||
-					!strncasecmp(c, "yes", 3))
-				verbose = 1;
-		}	
-	} while (!feof(config_file));
+static void url_cache_store(struct url_cache *cache, const char *url,
+			    size_t len, const char *small)
+{
+	struct url_cache_slot *victim = NULL;
+	struct url_cache_slot *slot;
+	uint64_t hash = hash_string(url, len) | 1;
+	time_t now = time(NULL);
+	int i;
 
-	if (password)
-		session->password = password;
-	if (account)
-		session->account = account;
-	if (host) {
-		if (strcasecmp(host, "twitter") == 0) {
-			session->host = HOST_TWITTER;
-			session->hosturl = strdup(twitter_host);
-		} else if (strcasecmp(host, "identica") == 0) {
-			session->host = HOST_IDENTICA;
-			session->hosturl = strdup(identica_host);
-		} else {
-			session->host = HOST_CUSTOM;
-			session->hosturl = strdup(host);
+	if (len >= URL_CACHE_LONG || strlen(small) >= URL_CACHE_SHORT)
+		return;
+
+	flock(cache->fd, LOCK_EX);
+	for (i = 0; i < URL_CACHE_PROBES; i++) {
+		slot = &cache->slots[(hash + i) % URL_CACHE_SLOTS];
+		/* a free, expired or outdated slot can be taken right away */
+		if (!url_cache_live(cache, slot, now) ||
+		    (slot->hash == hash && !strncmp(slot->long_url, url, len) &&
+		     !slot->long_url[len])) {
+			victim = slot;
+			break;
 		}
-		free(host);
-	}
-	if (proxy) {
-		if (session->proxy)
-			free(session->proxy);
-		session->proxy = proxy;
-	}
-	if (logfile)
-		session->logfile = logfile;
-	if (action) {
-		if (strcasecmp(action, "update") == 0)
-			session->action = ACTION_UPDATE;
-		else if (strcasecmp(action, "friends") == 0)
-			session->action = ACTION_FRIENDS;
-		else if (strcasecmp(action, "user") == 0)
-			session->action = ACTION_USER;
-		else if (strcasecmp(action, "replies") == 0)
-			session->action = ACTION_REPLIES;
-		else if (strcasecmp(action, "public") == 0)
-			session->action = ACTION_PUBLIC;
-		else
-			session->action = ACTION_UNKNOWN;
-		free(action);
+		if (!victim || slot->used < victim->used)
+			victim = slot;
 	}
-	if (user)
-		session->user = user;
-	session->shrink_urls = shrink_urls;
 
-	/* Free buffer and close file.  */
-	free(line);
-	fclose(config_file);
+	memset(victim, 0, sizeof(*victim));
+	memcpy(victim->long_url, url, len);
+	strcpy(victim->short_url, small);
+	victim->created = now;
+	victim->used = now;
+	victim->hash = hash;
+	flock(cache->fd, LOCK_UN);
+}
+
+/*
+ * Local store of every status we have fetched.  Statuses are appended to
+ * a log file as compact records and never rewritten, except for the
+ * bitmap of timelines a status has been seen in.  A separate mmap'd
+ * open addressing table maps (host, id) to the offset of the record, so
+ * a status that shows up again is not stored twice.  The index is only
+ * a cache of the log: it remembers how much of the log it covers and
+ * indexes whatever other processes appended since, or rebuilds itself
+ * from scratch if it does not match.
+ */
+static const char *status_store_file = ".bti_store";
+
+#define STATUS_LOG_MAGIC	"BTILOG01"
+#define STATUS_INDEX_MAGIC	"BTIIDX01"
+#define STATUS_INDEX_SLOTS	1024
+
+struct status_record {
+	uint32_t length;	/* of the whole record, a multiple of 8 */
+	uint32_t timelines;	/* ACTION_* bits this status was seen in */
+	uint64_t id;
+	uint32_t host;
+	uint32_t text_len;
+	uint16_t created_len;
+	uint16_t user_len;
+	uint32_t reserved;
+	char data[];		/* created, user and text, NUL terminated */
+};
+
+struct status_index_header {
+	char magic[8];
+	uint64_t slots;
+	uint64_t count;
+	uint64_t log_size;
+};
+
+struct status_index_slot {
+	uint64_t id;
+	uint64_t offset;
+	uint32_t host;
+	uint32_t pad;
+};
+
+struct status_store {
+	int log_fd;
+	int index_fd;
+	size_t index_size;
+	struct status_index_header *index;
+	struct status_index_slot *slots;
+};
+
+static uint32_t status_host(const char *hosturl)
+{
+	if (!hosturl)
+		hosturl = "";
+	return (uint32_t)hash_string(hosturl, strlen(hosturl));
 }
 
-static void log_session(struct session *session, int retval)
+static const char *status_record_created(const struct status_record *rec)
 {
-	FILE *log_file;
-	char *filename;
-	char *host;
+	return rec->data;
+}
 
-	/* Only log something if we have a log file set */
-	if (!session->logfile)
-		return;
+static const char *status_record_user(const struct status_record *rec)
+{
+	return rec->data + rec->created_len + 1;
+}
+
+static const char *status_record_text(const struct status_record *rec)
+{
+	return rec->data + rec->created_len + rec->user_len + 2;
+}
 
-	filename = alloca(strlen(session->homedir) +
-			  strlen(session->logfile) + 3);
+/*
+ * Returns the record at @offset of the @size bytes at @log, or NULL if
+ * there is no complete and sane one.
+ */
+static const struct status_record *status_record_at(const char *log,
+						    size_t size,
+						    size_t offset)
+{
+	const struct status_record *rec;
 
-	sprintf(filename, "%s/%s", session->homedir, session->logfile);
+	if (offset + sizeof(*rec) > size)
+		return NULL;
+	rec = (const struct status_record *)(log + offset);
+	if (rec->length < sizeof(*rec) || rec->length % 8 ||
+	    rec->length > size - offset || !rec->id ||
+	    sizeof(*rec) + rec->created_len + rec->user_len +
+	    (size_t)rec->text_len + 3 > rec->length)
+		return NULL;
+	if (status_record_created(rec)[rec->created_len] ||
+	    status_record_user(rec)[rec->user_len] ||
+	    status_record_text(rec)[rec->text_len])
+		return NULL;
+	return rec;
+}
 
-	log_file = fopen(filename, "a+");
-	if (log_file == NULL)
-		return;
-	switch (session->host) {
-	case HOST_TWITTER:
-		host = "twitter";
-		break;
-	case HOST_IDENTICA:
-		host = "identi.ca";
-		break;
-	default:
-		host = session->hosturl;
-		break;
+static int status_index_map(struct status_store *store, uint64_t slots)
+{
+	size_t size = sizeof(struct status_index_header) +
+		      slots * sizeof(struct status_index_slot);
+	void *map;
+
+	if (store->index)
+		munmap(store->index, store->index_size);
+	store->index = NULL;
+	if (ftruncate(store->index_fd, size) < 0)
+		return -errno;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   store->index_fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+	store->index = map;
+	store->index_size = size;
+	store->slots = (struct status_index_slot *)(store->index + 1);
+	return 0;
+}
+
+static void status_index_reset(struct status_store *store)
+{
+	memset(store->index, 0, store->index_size);
+	memcpy(store->index->magic, STATUS_INDEX_MAGIC, 8);
+	store->index->slots = (store->index_size - sizeof(*store->index)) /
+			      sizeof(struct status_index_slot);
+	store->index->log_size = sizeof(STATUS_LOG_MAGIC) - 1;
+}
+
+static struct status_index_slot *status_index_slot(struct status_store *store,
+						   uint32_t host, uint64_t id)
+{
+	struct status_index_slot *slot;
+	uint64_t i = (id ^ ((uint64_t)host << 32)) * 0x9e3779b97f4a7c15ULL;
+
+	for (;; i++) {
+		slot = &store->slots[i % store->index->slots];
+		if (!slot->id || (slot->id == id && slot->host == host))
+			return slot;
 	}
+}
 
-	switch (session->action) {
-	case ACTION_UPDATE:
+static int status_index_insert(struct status_store *store, uint32_t host,
+			       uint64_t id, uint64_t offset)
+{
+	struct status_index_slot *old;
+	struct status_index_slot *slot;
+	uint64_t slots = store->index->slots;
+	uint64_t i;
+	int retval;
+
+	/* keep the table at most half full so probe sequences stay short */
+	if ((store->index->count + 1) * 2 > slots) {
+		old = malloc(slots * sizeof(*old));
+		if (!old)
+			return -ENOMEM;
+		memcpy(old, store->slots, slots * sizeof(*old));
+		retval = status_index_map(store, slots * 2);
+		if (retval) {
+			free(old);
+			return retval;
+		}
+		memset(store->slots, 0, slots * 2 * sizeof(*old));
+		store->index->slots = slots * 2;
+		for (i = 0; i < slots; i++) {
+			if (!old[i].id)
+				continue;
+			slot = status_index_slot(store, old[i].host,
+						 old[i].id);
+			*slot = old[i];
+		}
+		free(old);
+	}
+
+	slot = status_index_slot(store, host, id);
+	if (!slot->id)
+		store->index->count++;
+	slot->id = id;
+	slot->host = host;
+	slot->offset = offset;
+	return 0;
+}
+
+/*
+ * Index whatever was appended to the log since the index was last
+ * updated.  A torn record at the end, from a crash in the middle of an
+ * append, is cut off.  Called with the log locked.
+ */
+static int status_store_catch_up(struct status_store *store)
+{
+	const struct status_record *rec;
+	struct stat st;
+	uint64_t offset;
+	char *log;
+	uint64_t slots;
+	int retval = 0;
+
+	if (!store->index)
+		return -ENOMEM;
+
+	/*
+	 * Another bti may have grown the index since it was mapped here,
+	 * in which case the slots past the end of our mapping are not ours
+	 * to touch until it is mapped again at the new size.
+	 */
+	slots = store->index->slots;
+	if (slots != (store->index_size - sizeof(*store->index)) /
+		     sizeof(struct status_index_slot)) {
+		retval = status_index_map(store, slots);
 		if (retval)
-			fprintf(log_file, "%s: host=%s tweet failed\n",
-				session->time, host);
-		else
-			fprintf(log_file, "%s: host=%s tweet=%s\n",
-				session->time, host, session->tweet);
-		break;
-	case ACTION_FRIENDS:
-		fprintf(log_file, "%s: host=%s retrieving friends timeline\n",
-			session->time, host);
-		break;
-	case ACTION_USER:
-		fprintf(log_file, "%s: host=%s retrieving %s's timeline\n",
-			session->time, host, session->user);
-		break;
-	case ACTION_REPLIES:
-		fprintf(log_file, "%s: host=%s retrieving replies\n",
-			session->time, host);
-		break;
-	case ACTION_PUBLIC:
-		fprintf(log_file, "%s: host=%s retrieving public timeline\n",
-			session->time, host);
-		break;
-	default:
-		break;
+			return retval;
+	}
+
+	if (fstat(store->log_fd, &st) < 0)
+		return -errno;
+	if ((uint64_t)st.st_size < store->index->log_size)
+		status_index_reset(store);
+	if ((uint64_t)st.st_size == store->index->log_size)
+		return 0;
+
+	log = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, store->log_fd, 0);
+	if (log == MAP_FAILED)
+		return -errno;
+	offset = store->index->log_size;
+	while ((rec = status_record_at(log, st.st_size, offset))) {
+		retval = status_index_insert(store, rec->host, rec->id,
+					     offset);
+		if (retval)
+			break;
+		offset += rec->length;
+	}
+	munmap(log, st.st_size);
+
+	if (!retval && offset != (uint64_t)st.st_size) {
+		dbg("dropping %llu bytes of torn status log\n",
+		    (unsigned long long)(st.st_size - offset));
+		if (ftruncate(store->log_fd, offset) < 0)
+			retval = -errno;
 	}
+	store->index->log_size = offset;
+	return retval;
+}
 
-	fclose(log_file);
+static void status_store_close(struct status_store *store)
+{
+	if (!store)
+		return;
+	if (store->index)
+		munmap(store->index, store->index_size);
+	if (store->index_fd >= 0)
+		close(store->index_fd);
+	if (store->log_fd >= 0)
+		close(store->log_fd);
+	free(store);
 }
 
-static char *get_string_from_stdin(void)
+static struct status_store *status_store_open(const char *homedir)
 {
-	char *temp;
-	char *string;
+	struct status_store *store;
+	struct stat st;
+	char magic[8];
+	char *file;
 
-	string = zalloc(1000);
-	if (!string)
+	store = zalloc(sizeof(*store));
+	if (!store)
 		return NULL;
+	store->index_fd = -1;
+
+	file = alloca(strlen(homedir) + strlen(status_store_file) + 6);
+	sprintf(file, "%s/%s", homedir, status_store_file);
+	store->log_fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (store->log_fd < 0)
+		goto error;
+	strcat(file, ".idx");
+	store->index_fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (store->index_fd < 0)
+		goto error;
+
+	/* the index is only ever touched with the log locked */
+	flock(store->log_fd, LOCK_EX);
+	if (fstat(store->log_fd, &st) < 0)
+		goto error_unlock;
+	if (st.st_size == 0 &&
+	    write(store->log_fd, STATUS_LOG_MAGIC, 8) != 8)
+		goto error_unlock;
+	if (pread(store->log_fd, magic, 8, 0) != 8 ||
+	    memcmp(magic, STATUS_LOG_MAGIC, 8)) {
+		fprintf(stderr, "%s is not a status store\n",
+			status_store_file);
+		goto error_unlock;
+	}
 
-	if (!fgets(string, 999, stdin))
-		return NULL;
-	temp = strchr(string, '\n');
-	*temp = '\0';
-	return string;
+	if (fstat(store->index_fd, &st) < 0)
+		goto error_unlock;
+	if ((size_t)st.st_size < sizeof(*store->index) +
+				 sizeof(struct status_index_slot)) {
+		if (status_index_map(store, STATUS_INDEX_SLOTS))
+			goto error_unlock;
+		status_index_reset(store);
+	} else {
+		if (status_index_map(store,
+				     (st.st_size - sizeof(*store->index)) /
+				     sizeof(struct status_index_slot)))
+			goto error_unlock;
+		if (memcmp(store->index->magic, STATUS_INDEX_MAGIC, 8) ||
+		    store->index->slots != (store->index_size -
+					    sizeof(*store->index)) /
+					   sizeof(struct status_index_slot))
+			status_index_reset(store);
+	}
+	if (status_store_catch_up(store))
+		goto error_unlock;
+	flock(store->log_fd, LOCK_UN);
+	return store;
+
+error_unlock:
+	flock(store->log_fd, LOCK_UN);
+error:
+	status_store_close(store);
+	return NULL;
 }
 
-static int find_urls(const char *tweet, int **pranges)
+/*
+ * Add a status to the store, or just note the timeline for a status we
+ * already have.
+ */
+static int status_store_append(struct status_store *store, uint32_t host,
+			       unsigned int timeline, uint64_t id,
+			       const char *created, const char *user,
+			       const char *text)
 {
-	/*
-	 * magic obtained from
-	 * http://www.geekpedia.com/KB65_How-to-validate-an-URL-using-RegEx-in-Csharp.html
-	 */
-	static const char *re_magic =
-		"(([a-zA-Z][0-9a-zA-Z+\\-\\.]*:)/{1,3}"
-		"[0-9a-zA-Z;/~?:@&=+$\\.\\-_'()%]+)"
-		"(#[0-9a-zA-Z;/?:@&=+$\\.\\-_!~*'()%]+)?";
-	pcre *re;
-	const char *errptr;
-	int erroffset;
-	int ovector[10] = {0,};
-	const size_t ovsize = sizeof(ovector)/sizeof(*ovector);
-	int startoffset, tweetlen;
-	int i, rc;
-	int rbound = 10;
-	int rcount = 0;
-	int *ranges = malloc(sizeof(int) * rbound);
+	struct status_index_slot *slot;
+	struct status_record *rec;
+	size_t created_len = strlen(created);
+	size_t user_len = strlen(user);
+	size_t text_len = strlen(text);
+	size_t length;
+	uint32_t timelines;
+	int retval;
+
+	if (!id || created_len > UINT16_MAX || user_len > UINT16_MAX ||
+	    text_len > UINT32_MAX / 2)
+		return -EINVAL;
 
-	re = pcre_compile(re_magic,
-			PCRE_NO_AUTO_CAPTURE,
-			&errptr, &erroffset, NULL);
-	if (!re) {
-		fprintf(stderr, "pcre_compile @%u: %s\n", erroffset, errptr);
-		exit(1);
+	flock(store->log_fd, LOCK_EX);
+	retval = status_store_catch_up(store);
+	if (retval)
+		goto exit;
+
+	slot = status_index_slot(store, host, id);
+	if (slot->id) {
+		if (pread(store->log_fd, &timelines, sizeof(timelines),
+			  slot->offset + 4) != sizeof(timelines)) {
+			retval = -EIO;
+			goto exit;
+		}
+		if (!(timelines & timeline)) {
+			timelines |= timeline;
+			if (pwrite(store->log_fd, &timelines,
+				   sizeof(timelines), slot->offset + 4) !=
+			    sizeof(timelines))
+				retval = -EIO;
+		}
+		goto exit;
+	}
+
+	length = (sizeof(*rec) + created_len + user_len + text_len + 3 + 7) &
+		 ~(size_t)7;
+	rec = zalloc(length);
+	if (!rec) {
+		retval = -ENOMEM;
+		goto exit;
 	}
+	rec->length = length;
+	rec->timelines = timeline;
+	rec->id = id;
+	rec->host = host;
+	rec->created_len = created_len;
+	rec->user_len = user_len;
+	rec->text_len = text_len;
+	memcpy(rec->data, created, created_len);
+	memcpy(rec->data + created_len + 1, user, user_len);
+	memcpy(rec->data + created_len + user_len + 2, text, text_len);
+
+	/* caught up with the lock held, so log_size is the end of the file */
+	if (pwrite(store->log_fd, rec, length, store->index->log_size) !=
+	    (ssize_t)length) {
+		retval = -EIO;
+		free(rec);
+		goto exit;
+	}
+	free(rec);
 
-	tweetlen = strlen(tweet);
-	for (startoffset = 0; startoffset < tweetlen; ) {
+	retval = status_index_insert(store, host, id, store->index->log_size);
+	store->index->log_size += length;
 
-		rc = pcre_exec(re, NULL, tweet, strlen(tweet), startoffset, 0,
-				ovector, ovsize);
-		if (rc == PCRE_ERROR_NOMATCH)
-			break;
+exit:
+	flock(store->log_fd, LOCK_UN);
+	return retval;
+}
 
-		if (rc < 0) {
-			fprintf(stderr, "pcre_exec @%u: %s\n",
-				erroffset, errptr);
-			exit(1);
-		}
+/*
+ * Full text index over the status store.  Like the id index it is only
+ * derived from the log: after every fetch the records appended since the
+ * last update are tokenized and written as one more immutable segment
+ * to ~/.bti_search.  A segment is a sorted term table followed by the
+ * posting lists, which hold the store offsets of the records with that
+ * term as varint encoded deltas.  Segments cover consecutive ranges of
+ * the log, so the lists of all segments concatenate in order.  Once
+ * there are too many of them the whole index is rebuilt as one.
+ */
+static const char *search_file = ".bti_search";
+
+#define SEARCH_MAGIC		"BTISEG01"
+#define SEARCH_TERM_MAX		64
+#define SEARCH_MAX_SEGMENTS	16
+
+struct search_segment {
+	char magic[8];
+	uint64_t length;	/* of the whole segment, a multiple of 8 */
+	uint64_t first;		/* range of the log it covers */
+	uint64_t end;
+	uint32_t nterms;
+	uint32_t pad;
+};
 
-		for (i = 0; i < rc; i += 2) {
-			if ((rcount+2) == rbound) {
-				rbound *= 2;
-				ranges = realloc(ranges, sizeof(int) * rbound);
-			}
+struct search_term {
+	uint32_t term;		/* offsets relative to the segment */
+	uint32_t term_len;
+	uint32_t postings;
+	uint32_t postings_len;
+	uint32_t count;
+	uint32_t pad;
+};
 
-			ranges[rcount++] = ovector[i];
-			ranges[rcount++] = ovector[i+1];
-		}
+struct search_posting {
+	char *term;
+	size_t term_len;
+	uint64_t last;
+	uint32_t count;
+	unsigned char *data;
+	size_t length;
+	size_t size;
+};
 
-		startoffset = ovector[1];
+struct search_builder {
+	struct search_posting *table;
+	size_t size;
+	size_t used;
+	size_t term_bytes;
+	size_t posting_bytes;
+};
+
+/*
+ * Returns the length of the next word at *@text, lower cased into @term
+ * and cut at SEARCH_TERM_MAX, and moves *@text past it.  Anything that
+ * is not ascii punctuation or space is part of a word, so utf-8 text
+ * is indexed as is.
+ */
+static size_t search_token(const char **text, char *term)
+{
+	const unsigned char *p = (const unsigned char *)*text;
+	size_t len = 0;
+
+	while (*p && !isalnum(*p) && *p != '_' && *p < 0x80)
+		p++;
+	while (*p && (isalnum(*p) || *p == '_' || *p >= 0x80)) {
+		if (len < SEARCH_TERM_MAX)
+			term[len++] = *p < 0x80 ? tolower(*p) : *p;
+		p++;
 	}
+	*text = (const char *)p;
+	return len;
+}
 
-	pcre_free(re);
+static int search_varint(struct search_posting *posting, uint64_t value)
+{
+	unsigned char *temp;
+	size_t size;
+
+	if (posting->length + 10 > posting->size) {
+		size = posting->size ? posting->size * 2 : 16;
+		temp = realloc(posting->data, size);
+		if (!temp)
+			return -ENOMEM;
+		posting->data = temp;
+		posting->size = size;
+	}
+	while (value >= 0x80) {
+		posting->data[posting->length++] = value | 0x80;
+		value >>= 7;
+	}
+	posting->data[posting->length++] = value;
+	return 0;
+}
 
-	*pranges = ranges;
-	return rcount;
+static const unsigned char *search_varint_read(const unsigned char *p,
+					       const unsigned char *end,
+					       uint64_t *value)
+{
+	int shift = 0;
+
+	*value = 0;
+	while (p < end && shift < 64) {
+		*value |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+static struct search_posting *search_lookup(struct search_builder *builder,
+					    const char *term, size_t len)
+{
+	struct search_posting *posting;
+	size_t i = hash_string(term, len);
+
+	for (;; i++) {
+		posting = &builder->table[i & (builder->size - 1)];
+		if (!posting->term || (posting->term_len == len &&
+				       !memcmp(posting->term, term, len)))
+			return posting;
+	}
+}
+
+static int search_builder_add(struct search_builder *builder,
+			      const char *term, size_t len, uint64_t offset)
+{
+	struct search_posting *posting;
+	struct search_posting *old;
+	size_t size = builder->size;
+	size_t i;
+	int retval;
+
+	if ((builder->used + 1) * 2 > size) {
+		old = builder->table;
+		builder->size = size ? size * 2 : 1024;
+		builder->table = zalloc(builder->size * sizeof(*old));
+		if (!builder->table) {
+			builder->table = old;
+			builder->size = size;
+			return -ENOMEM;
+		}
+		for (i = 0; i < size; i++)
+			if (old[i].term)
+				*search_lookup(builder, old[i].term,
+					       old[i].term_len) = old[i];
+		free(old);
+	}
+
+	posting = search_lookup(builder, term, len);
+	if (!posting->term) {
+		posting->term = malloc(len);
+		if (!posting->term)
+			return -ENOMEM;
+		memcpy(posting->term, term, len);
+		posting->term_len = len;
+		builder->used++;
+		builder->term_bytes += len;
+	}
+	/* a word that shows up twice in a status is listed once */
+	if (posting->count && posting->last == offset)
+		return 0;
+
+	builder->posting_bytes -= posting->length;
+	retval = search_varint(posting, (offset - posting->last) / 8);
+	builder->posting_bytes += posting->length;
+	if (retval)
+		return retval;
+	posting->last = offset;
+	posting->count++;
+	return 0;
+}
+
+static int search_builder_record(struct search_builder *builder,
+				 const struct status_record *rec,
+				 uint64_t offset)
+{
+	char term[SEARCH_TERM_MAX];
+	const char *fields[2] = {
+		status_record_user(rec), status_record_text(rec),
+	};
+	const char *p;
+	size_t len;
+	int retval;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		p = fields[i];
+		while ((len = search_token(&p, term))) {
+			retval = search_builder_add(builder, term, len,
+						    offset);
+			if (retval)
+				return retval;
+		}
+	}
+	return 0;
+}
+
+static void search_builder_free(struct search_builder *builder)
+{
+	size_t i;
+
+	for (i = 0; i < builder->size; i++) {
+		free(builder->table[i].term);
+		free(builder->table[i].data);
+	}
+	free(builder->table);
+}
+
+static int search_term_cmp(const char *a, size_t a_len, const char *b,
+			   size_t b_len)
+{
+	int cmp;
+
+	cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+	if (cmp)
+		return cmp;
+	return (a_len > b_len) - (a_len < b_len);
+}
+
+static int search_posting_cmp(const void *a, const void *b)
+{
+	const struct search_posting *pa = *(const struct search_posting **)a;
+	const struct search_posting *pb = *(const struct search_posting **)b;
+
+	return search_term_cmp(pa->term, pa->term_len, pb->term,
+			       pb->term_len);
+}
+
+/*
+ * Index the records of @log in [first, end) and write them as a segment
+ * at @where, which is where the file ends afterwards.
+ */
+static int search_write_segment(int fd, off_t where, const char *log,
+				uint64_t first, uint64_t end)
+{
+	struct search_builder builder = { };
+	const struct status_record *rec;
+	struct search_posting **sorted = NULL;
+	struct search_segment *seg;
+	struct search_term *terms;
+	uint64_t offset;
+	size_t length;
+	size_t pos;
+	size_t i;
+	size_t n = 0;
+	char *buf = NULL;
+	int retval = 0;
+
+	for (offset = first; offset < end; offset += rec->length) {
+		rec = status_record_at(log, end, offset);
+		if (!rec)
+			break;
+		retval = search_builder_record(&builder, rec, offset);
+		if (retval)
+			goto exit;
+	}
+
+	sorted = malloc((builder.used + 1) * sizeof(*sorted));
+	if (!sorted) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+	for (i = 0; i < builder.size; i++)
+		if (builder.table[i].term)
+			sorted[n++] = &builder.table[i];
+	qsort(sorted, n, sizeof(*sorted), search_posting_cmp);
+
+	length = sizeof(*seg) + n * sizeof(*terms) + builder.term_bytes +
+		 builder.posting_bytes;
+	length = (length + 7) & ~(size_t)7;
+	buf = zalloc(length);
+	if (!buf) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+	seg = (struct search_segment *)buf;
+	memcpy(seg->magic, SEARCH_MAGIC, 8);
+	seg->length = length;
+	seg->first = first;
+	seg->end = end;
+	seg->nterms = n;
+	terms = (struct search_term *)(seg + 1);
+	pos = sizeof(*seg) + n * sizeof(*terms);
+	for (i = 0; i < n; i++) {
+		terms[i].term = pos;
+		terms[i].term_len = sorted[i]->term_len;
+		memcpy(buf + pos, sorted[i]->term, sorted[i]->term_len);
+		pos += sorted[i]->term_len;
+	}
+	for (i = 0; i < n; i++) {
+		terms[i].postings = pos;
+		terms[i].postings_len = sorted[i]->length;
+		terms[i].count = sorted[i]->count;
+		memcpy(buf + pos, sorted[i]->data, sorted[i]->length);
+		pos += sorted[i]->length;
+	}
+
+	if (pwrite(fd, buf, length, where) != (ssize_t)length)
+		retval = -EIO;
+	else if (ftruncate(fd, where + length) < 0)
+		retval = -errno;
+	dbg("indexed %llu bytes of statuses, %zu terms, %zu bytes\n",
+	    (unsigned long long)(end - first), n, length);
+
+exit:
+	free(buf);
+	free(sorted);
+	search_builder_free(&builder);
+	return retval;
+}
+
+/*
+ * Returns the segment at @offset of the @size bytes at @map, or NULL if
+ * there is no complete one.
+ */
+static const struct search_segment *search_segment_at(const char *map,
+						      size_t size,
+						      size_t offset)
+{
+	const struct search_segment *seg;
+
+	if (offset + sizeof(*seg) > size)
+		return NULL;
+	seg = (const struct search_segment *)(map + offset);
+	if (memcmp(seg->magic, SEARCH_MAGIC, 8) || seg->length % 8 ||
+	    seg->length > size - offset ||
+	    seg->length < sizeof(*seg) +
+			  (uint64_t)seg->nterms * sizeof(struct search_term))
+		return NULL;
+	return seg;
+}
+
+/*
+ * Bring the search index up to date with the store.  Everything the
+ * last segment does not cover yet becomes a new segment, unless that
+ * would make too many, in which case the index is rebuilt in a new file
+ * that replaces the old one.
+ */
+static int search_index_update(struct status_store *store,
+			       const char *homedir)
+{
+	const struct search_segment *seg;
+	uint64_t covered = sizeof(STATUS_LOG_MAGIC) - 1;
+	uint64_t log_size;
+	struct stat st;
+	size_t offset = 0;
+	char *map = NULL;
+	char *log = NULL;
+	char *file;
+	char *tmp;
+	int segments = 0;
+	int fd = -1;
+	int retval;
+
+	file = alloca(strlen(homedir) + strlen(search_file) + 2);
+	sprintf(file, "%s/%s", homedir, search_file);
+
+	flock(store->log_fd, LOCK_EX);
+	retval = status_store_catch_up(store);
+	if (retval)
+		goto exit;
+	log_size = store->index->log_size;
+
+	fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		retval = -errno;
+		goto exit;
+	}
+	if (st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+			retval = -errno;
+			goto exit;
+		}
+	}
+	while ((seg = search_segment_at(map, st.st_size, offset))) {
+		if (seg->first != covered || seg->end > log_size)
+			break;
+		covered = seg->end;
+		offset += seg->length;
+		segments++;
+	}
+	if (covered == log_size) {
+		/* cut off whatever was left behind by a crash */
+		if (offset != (size_t)st.st_size && ftruncate(fd, offset) < 0)
+			retval = -errno;
+		goto exit;
+	}
+
+	log = mmap(NULL, log_size, PROT_READ, MAP_SHARED, store->log_fd, 0);
+	if (log == MAP_FAILED) {
+		log = NULL;
+		retval = -errno;
+		goto exit;
+	}
+
+	if (segments < SEARCH_MAX_SEGMENTS) {
+		retval = search_write_segment(fd, offset, log, covered,
+					      log_size);
+		goto exit;
+	}
+
+	tmp = alloca(strlen(file) + 8);
+	sprintf(tmp, "%s.XXXXXX", file);
+	close(fd);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		retval = -errno;
+		goto exit;
+	}
+	retval = search_write_segment(fd, 0, log,
+				      sizeof(STATUS_LOG_MAGIC) - 1, log_size);
+	if (!retval && rename(tmp, file) < 0)
+		retval = -errno;
+	if (retval)
+		unlink(tmp);
+
+exit:
+	if (log)
+		munmap(log, log_size);
+	if (map)
+		munmap(map, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	flock(store->log_fd, LOCK_UN);
+	return retval;
+}
+
+static struct session *session_alloc(void)
+{
+	struct session *session;
+
+	session = zalloc(sizeof(*session));
+	if (!session)
+		return NULL;
+	session->max_body = BTI_MAX_BODY;
+	session->jobs = 4;
+	session->batch_delim = '\n';
+	session->shrink_timeout = 5;
+	session->url_cache_enabled = 1;
+	session->url_cache_ttl = 30 * 24 * 60 * 60;
+	session->net_cache_enabled = 1;
+	session->net_cache_ttl = 10 * 60;
+	session->store_enabled = 1;
+	session->follow_min = 30;
+	session->follow_max = 300;
+	session->log_max_size = 16 * 1024 * 1024;
+	return session;
+}
+
+static const char *twitter_host  = "https://twitter.com/statuses";
+static const char *identica_host = "https://identi.ca/api/statuses";
+
+/* Map a host name from the config or command line to its API url */
+static char *parse_host(const char *name, enum host *host)
+{
+	if (strcasecmp(name, "twitter") == 0) {
+		*host = HOST_TWITTER;
+		return strdup(twitter_host);
+	} else if (strcasecmp(name, "identica") == 0) {
+		*host = HOST_IDENTICA;
+		return strdup(identica_host);
+	}
+	*host = HOST_CUSTOM;
+	return strdup(name);
+}
+
+static const char *user_uri    = "/user_timeline/";
+static const char *update_uri  = "/update.xml";
+static const char *public_uri  = "/public_timeline.xml";
+static const char *friends_uri = "/friends_timeline.xml";
+static const char *replies_uri = "/replies.xml";
+
+/*
+ * Small state files in the home directory, like the since_id
+ * checkpoints, hold one line per key: the key, which ends in a tab, and
+ * then the value.  A changed file is written to a temporary file that
+ * then atomically replaces the old one, so a concurrent reader sees
+ * either the old or the new file, never half of one.  Writers are
+ * serialized by a lock on a side file, as the file itself is replaced.
+ */
+static int state_lock(struct session *session, const char *name,
+		      int operation)
+{
+	char *file;
+	int fd;
+
+	file = alloca(strlen(session->homedir) + strlen(name) + 7);
+	sprintf(file, "%s/%s.lock", session->homedir, name);
+
+	fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+	if (flock(fd, operation) < 0) {
+		close(fd);
+		return -errno;
+	}
+	return fd;
+}
+
+/* Returns a copy of the value stored for @key, or NULL */
+static char *state_load(struct session *session, const char *name,
+			const char *key)
+{
+	size_t key_len = strlen(key);
+	char *value = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t count;
+	char *file;
+	FILE *state;
+	int lock;
+
+	lock = state_lock(session, name, LOCK_SH);
+	if (lock < 0)
+		return NULL;
+
+	file = alloca(strlen(session->homedir) + strlen(name) + 2);
+	sprintf(file, "%s/%s", session->homedir, name);
+
+	state = fopen(file, "r");
+	if (state) {
+		while ((count = getline(&line, &len, state)) > 0) {
+			if (strncmp(line, key, key_len))
+				continue;
+			if (line[count - 1] == '\n')
+				line[count - 1] = '\0';
+			value = strdup(line + key_len);
+			break;
+		}
+		free(line);
+		fclose(state);
+	}
+	close(lock);
+	return value;
+}
+
+/*
+ * Store @value for @key, unless @keep says the value already there,
+ * which may have been written by a concurrent run, is better.
+ */
+static int state_store(struct session *session, const char *name,
+		       const char *key, const char *value,
+		       int (*keep)(const char *old, const char *value))
+{
+	size_t key_len = strlen(key);
+	char *line = NULL;
+	size_t len = 0;
+	char *file;
+	char *tmp;
+	FILE *state;
+	FILE *out;
+	int lock;
+	int fd;
+	int kept = 0;
+	int retval = 0;
+
+	lock = state_lock(session, name, LOCK_EX);
+	if (lock < 0)
+		return lock;
+
+	file = alloca(strlen(session->homedir) + strlen(name) + 2);
+	sprintf(file, "%s/%s", session->homedir, name);
+	tmp = alloca(strlen(file) + 8);
+	sprintf(tmp, "%s.XXXXXX", file);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		retval = -errno;
+		goto exit;
+	}
+	out = fdopen(fd, "w");
+	if (!out) {
+		retval = -errno;
+		close(fd);
+		unlink(tmp);
+		goto exit;
+	}
+
+	state = fopen(file, "r");
+	if (state) {
+		while (getline(&line, &len, state) > 0) {
+			if (strncmp(line, key, key_len) ||
+			    (!kept && keep && keep(line + key_len, value))) {
+				kept |= !strncmp(line, key, key_len);
+				fputs(line, out);
+			}
+		}
+		free(line);
+		fclose(state);
+	}
+	if (!kept)
+		fprintf(out, "%s%s\n", key, value);
+
+	if (fflush(out) || fsync(fileno(out)))
+		retval = -errno;
+	if (fclose(out) && !retval)
+		retval = -errno;
+	if (!retval && rename(tmp, file) < 0)
+		retval = -errno;
+	if (retval)
+		unlink(tmp);
+
+exit:
+	close(lock);
+	return retval;
+}
+
+/*
+ * What it takes to get a connection to a host going is remembered from
+ * one run to the next, as every run of bti talks to the same one or two
+ * hosts.  The address a host resolved to is kept for net-cache-ttl
+ * seconds in ~/.bti_dns and handed to curl with CURLOPT_RESOLVE, so the
+ * lookup is skipped.  If that address does not take connections any
+ * more it is forgotten and the transfer is tried once more.  With a curl
+ * that can export them, the TLS sessions are kept in ~/.bti_tls until
+ * the server says they expire, so the next run resumes the session
+ * instead of doing a full handshake.  All handles of a run share their
+ * DNS and TLS session caches through a curl share handle.
+ */
+static const char dns_cache_file[] = ".bti_dns";
+
+/* The "host:port:" of @url, the way CURLOPT_RESOLVE wants it */
+static char *dns_cache_host(const char *url)
+{
+	CURLU *u;
+	char *host = NULL;
+	char *port = NULL;
+	char *key = NULL;
+
+	u = curl_url();
+	if (!u)
+		return NULL;
+	if (!curl_url_set(u, CURLUPART_URL, url, 0) &&
+	    !curl_url_get(u, CURLUPART_HOST, &host, 0) &&
+	    !curl_url_get(u, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) &&
+	    host[0] != '[') {
+		key = malloc(strlen(host) + strlen(port) + 3);
+		if (key)
+			sprintf(key, "%s:%s:", host, port);
+	}
+	curl_free(host);
+	curl_free(port);
+	curl_url_cleanup(u);
+	return key;
+}
+
+static struct curl_slist *dns_cache_entry(struct session *session,
+					  const char *key)
+{
+	struct curl_slist *entry;
+
+	for (entry = session->resolve; entry; entry = entry->next)
+		if (!strncmp(entry->data, key, strlen(key)))
+			return entry;
+	return NULL;
+}
+
+/* Look up the address of the host of @url that an earlier run saw */
+static void dns_cache_load(struct session *session, const char *url)
+{
+	char *state_key;
+	char *value;
+	char *key;
+	char *addr;
+
+	if (!url)
+		return;
+	key = dns_cache_host(url);
+	if (!key || dns_cache_entry(session, key)) {
+		free(key);
+		return;
+	}
+
+	state_key = alloca(strlen(key) + 2);
+	sprintf(state_key, "%s\t", key);
+	value = state_load(session, dns_cache_file, state_key);
+	addr = value ? strchr(value, '\t') : NULL;
+	if (addr && strtoll(value, NULL, 10) > time(NULL)) {
+		state_key = alloca(strlen(key) + strlen(addr));
+		sprintf(state_key, "%s%s", key, addr + 1);
+		session->resolve = curl_slist_append(session->resolve,
+						     state_key);
+		dbg("resolve %s\n", state_key);
+	}
+	free(value);
+	free(key);
+}
+
+/* Remember the address a transfer that went through connected to */
+static void dns_cache_learn(struct session *session, CURL *curl)
+{
+	char *url = NULL;
+	char *ip = NULL;
+	char *state_key;
+	char *value;
+	char *key;
+
+	if (!session->share || session->proxy)
+		return;
+	curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+	curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip);
+	if (!url || !ip || !ip[0])
+		return;
+	key = dns_cache_host(url);
+	/* known already, or a literal address that needs no lookup */
+	if (!key || dns_cache_entry(session, key) ||
+	    !strncmp(key, ip, strlen(ip))) {
+		free(key);
+		return;
+	}
+
+	state_key = alloca(strlen(key) + 2);
+	sprintf(state_key, "%s\t", key);
+	value = alloca(strlen(ip) + 32);
+	sprintf(value, "%lld\t%s%s%s",
+		(long long)(time(NULL) + session->net_cache_ttl),
+		strchr(ip, ':') ? "[" : "", ip, strchr(ip, ':') ? "]" : "");
+	state_store(session, dns_cache_file, state_key, value, NULL);
+
+	/* so that every later handle of this run knows it too */
+	state_key = alloca(strlen(key) + strlen(value));
+	sprintf(state_key, "%s%s", key, strchr(value, '\t') + 1);
+	session->resolve = curl_slist_append(session->resolve, state_key);
+	free(key);
+}
+
+/*
+ * A transfer could not connect.  If that was to a cached address, drop
+ * it from the cache, and from curl's, and return 1 so that the caller
+ * tries again with a fresh lookup.
+ */
+static int dns_cache_forget(struct session *session, CURL *curl)
+{
+	struct curl_slist *resolve = NULL;
+	struct curl_slist **stale;
+	struct curl_slist *entry;
+	char *url = NULL;
+	char *state_key;
+	char *key;
+
+	curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+	key = url ? dns_cache_host(url) : NULL;
+	if (!key || !dns_cache_entry(session, key)) {
+		free(key);
+		return 0;
+	}
+
+	state_key = alloca(strlen(key) + 2);
+	sprintf(state_key, "%s\t", key);
+	state_store(session, dns_cache_file, state_key, "0\t", NULL);
+
+	for (entry = session->resolve; entry; entry = entry->next)
+		if (strncmp(entry->data, key, strlen(key)))
+			resolve = curl_slist_append(resolve, entry->data);
+
+	/*
+	 * Handles waiting their turn in a multi still point at the old
+	 * list through CURLOPT_RESOLVE, so it is kept until the end of
+	 * the run rather than freed here.
+	 */
+	stale = realloc(session->stale_resolve,
+			(session->nstale_resolve + 1) * sizeof(*stale));
+	if (!stale) {
+		/* keep the old list, the address is forgotten next run */
+		curl_slist_free_all(resolve);
+	} else {
+		session->stale_resolve = stale;
+		stale[session->nstale_resolve++] = session->resolve;
+		session->resolve = resolve;
+	}
+
+	/* "-host:port" takes the entry out of curl's dns cache */
+	key[strlen(key) - 1] = '\0';
+	sprintf(state_key, "-%s", key);
+	session->unresolve = curl_slist_append(session->unresolve, state_key);
+	curl_easy_setopt(curl, CURLOPT_RESOLVE, session->unresolve);
+	dbg("forgot the address of %s\n", key);
+	free(key);
+	return 1;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+static const char tls_cache_file[] = ".bti_tls";
+
+/* Call @fn with every key, without its tab, and value in a state file */
+static void state_foreach(struct session *session, const char *name,
+			  void (*fn)(void *data, char *key, char *value),
+			  void *data)
+{
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t count;
+	char *value;
+	char *file;
+	FILE *state;
+	int lock;
+
+	lock = state_lock(session, name, LOCK_SH);
+	if (lock < 0)
+		return;
+
+	file = alloca(strlen(session->homedir) + strlen(name) + 2);
+	sprintf(file, "%s/%s", session->homedir, name);
+
+	state = fopen(file, "r");
+	if (state) {
+		while ((count = getline(&line, &len, state)) > 0) {
+			if (line[count - 1] == '\n')
+				line[count - 1] = '\0';
+			value = strchr(line, '\t');
+			if (!value)
+				continue;
+			*value++ = '\0';
+			fn(data, line, value);
+		}
+		free(line);
+		fclose(state);
+	}
+	close(lock);
+}
+
+static char *tls_cache_hex(const unsigned char *data, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *str;
+	size_t i;
+
+	str = malloc(2 * len + 1);
+	if (!str)
+		return NULL;
+	for (i = 0; i < len; i++) {
+		str[2 * i] = hex[data[i] >> 4];
+		str[2 * i + 1] = hex[data[i] & 15];
+	}
+	str[2 * len] = '\0';
+	return str;
+}
+
+/* Decode @str in place, returns the length of the data */
+static size_t tls_cache_unhex(char *str)
+{
+	unsigned char *data = (unsigned char *)str;
+	unsigned int byte;
+	size_t i;
+
+	for (i = 0; str[2 * i] && str[2 * i + 1]; i++) {
+		if (sscanf(str + 2 * i, "%2x", &byte) != 1)
+			return 0;
+		data[i] = byte;
+	}
+	return i;
+}
+
+static void tls_cache_import(void *data, char *key, char *value)
+{
+	CURL *curl = data;
+	char *shmac;
+	char *sdata;
+	size_t shmac_len;
+	size_t sdata_len;
+
+	shmac = strchr(value, '\t');
+	sdata = shmac ? strchr(shmac + 1, '\t') : NULL;
+	if (!sdata || strtoll(value, NULL, 10) <= time(NULL))
+		return;
+	*shmac++ = '\0';
+	*sdata++ = '\0';
+	shmac_len = tls_cache_unhex(shmac);
+	sdata_len = tls_cache_unhex(sdata);
+	if (sdata_len && !curl_easy_ssls_import(curl, key,
+						(unsigned char *)shmac,
+						shmac_len,
+						(unsigned char *)sdata,
+						sdata_len))
+		dbg("resuming tls session for %s\n", key);
+}
+
+static CURLcode tls_cache_export(CURL *curl, void *data, const char *key,
+				 const unsigned char *shmac, size_t shmac_len,
+				 const unsigned char *sdata, size_t sdata_len,
+				 curl_off_t valid_until, int ietf_tls_id,
+				 const char *alpn, size_t earlydata_max)
+{
+	struct session *session = data;
+	char *state_key;
+	char *value;
+	char *hex_shmac;
+	char *hex_sdata;
+
+	if (valid_until <= time(NULL) || strpbrk(key, "\t\n"))
+		return CURLE_OK;
+
+	hex_shmac = tls_cache_hex(shmac, shmac_len);
+	hex_sdata = tls_cache_hex(sdata, sdata_len);
+	state_key = alloca(strlen(key) + 2);
+	sprintf(state_key, "%s\t", key);
+	if (hex_shmac && hex_sdata &&
+	    asprintf(&value, "%lld\t%s\t%s", (long long)valid_until,
+		     hex_shmac, hex_sdata) >= 0) {
+		state_store(session, tls_cache_file, state_key, value, NULL);
+		free(value);
+	}
+	free(hex_shmac);
+	free(hex_sdata);
+	return CURLE_OK;
+}
+#endif
+
+/*
+ * Start the share handle on the first curl handle of the run, and fill
+ * it with what earlier runs have left in the caches.
+ */
+static void net_cache_open(struct session *session, CURL *curl)
+{
+	int i;
+
+	session->share = curl_share_init();
+	if (!session->share)
+		return;
+	curl_share_setopt(session->share, CURLSHOPT_SHARE,
+			  CURL_LOCK_DATA_DNS);
+	curl_share_setopt(session->share, CURLSHOPT_SHARE,
+			  CURL_LOCK_DATA_SSL_SESSION);
+	curl_easy_setopt(curl, CURLOPT_SHARE, session->share);
+
+	/* with a proxy it is the proxy that resolves the host */
+	if (!session->proxy) {
+		dns_cache_load(session, session->hosturl);
+		for (i = 0; i < session->ntargets; i++)
+			dns_cache_load(session, session->targets[i].hosturl);
+	}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+	state_foreach(session, tls_cache_file, tls_cache_import, curl);
+#endif
+}
+
+/* Save the TLS sessions of this run, if it made any connections */
+static void net_cache_close(struct session *session)
+{
+	int i;
+#if LIBCURL_VERSION_NUM >= 0x080c00
+	CURL *curl;
+
+	if (session->share && session->times.tls > 0) {
+		curl = curl_easy_init();
+		if (curl) {
+			curl_easy_setopt(curl, CURLOPT_SHARE, session->share);
+			curl_easy_ssls_export(curl, tls_cache_export, session);
+			curl_easy_cleanup(curl);
+		}
+	}
+#endif
+	if (session->share)
+		curl_share_cleanup(session->share);
+	curl_slist_free_all(session->resolve);
+	for (i = 0; i < session->nstale_resolve; i++)
+		curl_slist_free_all(session->stale_resolve[i]);
+	free(session->stale_resolve);
+	curl_slist_free_all(session->unresolve);
+}
+
+static void curl_setup(struct session *session, CURL *curl)
+{
+	/* some ssl sanity checks on the connection we are making */
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+
+	if (!session->net_cache_enabled)
+		return;
+	if (!session->share)
+		net_cache_open(session, curl);
+	if (session->share)
+		curl_easy_setopt(curl, CURLOPT_SHARE, session->share);
+	if (session->resolve)
+		curl_easy_setopt(curl, CURLOPT_RESOLVE, session->resolve);
+}
+
+static CURL *curl_init(struct session *session)
+{
+	static int initialized;
+	CURL *curl;
+
+	/*
+	 * Setting up curl sets up the TLS library too, which is the most
+	 * expensive part of starting bti, so only the runs that actually
+	 * talk to a server pay for it.
+	 */
+	if (!initialized) {
+		curl_global_init(CURL_GLOBAL_ALL);
+		initialized = 1;
+	}
+
+	curl = curl_easy_init();
+	if (!curl) {
+		fprintf(stderr, "Can not init CURL!\n");
+		return NULL;
+	}
+	curl_setup(session, curl);
+	return curl;
+}
+
+/*
+ * Hand out a long lived CURL handle, creating it on first use.  Reusing
+ * the handle keeps its connection cache warm, so consecutive requests to
+ * the same host skip the TCP and TLS handshakes.
+ */
+static CURL *curl_reuse(struct session *session, CURL **curl)
+{
+	if (!*curl) {
+		*curl = curl_init(session);
+		return *curl;
+	}
+	curl_easy_reset(*curl);
+	curl_setup(session, *curl);
+	return *curl;
+}
+
+/* Add the screen names of a comma separated list to --from */
+static int status_filter_from(struct status_filter *filter, const char *list)
+{
+	char **from;
+	char *names;
+	char *name;
+	char *save;
+
+	names = strdupa(list);
+	for (name = strtok_r(names, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		from = realloc(filter->from,
+			       (filter->nfrom + 1) * sizeof(*from));
+		if (!from)
+			return -ENOMEM;
+		filter->from = from;
+		from[filter->nfrom] = strdup(name);
+		if (!from[filter->nfrom])
+			return -ENOMEM;
+		filter->nfrom++;
+	}
+	return 0;
+}
+
+/*
+ * Set the --grep pattern.  It is a pcre regular expression, but most
+ * are plain words, and those are looked for with memmem() instead.
+ */
+static int status_filter_grep(struct status_filter *filter,
+			      const char *pattern)
+{
+	const char *errptr;
+	int erroffset;
+	int options = 0;
+
+	free(filter->grep);
+	if (filter->extra)
+		pcre_free_study(filter->extra);
+	if (filter->re)
+		pcre_free(filter->re);
+	filter->extra = NULL;
+	filter->re = NULL;
+
+	filter->grep = strdup(pattern);
+	if (!filter->grep)
+		return -ENOMEM;
+	filter->literal = !strpbrk(pattern, "\\^$.[]|()?*+{}");
+	if (filter->literal)
+		return 0;
+
+	filter->re = pcre_compile(pattern, PCRE_NO_AUTO_CAPTURE, &errptr,
+				  &erroffset, NULL);
+	if (!filter->re) {
+		fprintf(stderr, "--grep @%u: %s\n", erroffset, errptr);
+		return -EINVAL;
+	}
+#ifdef PCRE_STUDY_JIT_COMPILE
+	options |= PCRE_STUDY_JIT_COMPILE;
+#endif
+	filter->extra = pcre_study(filter->re, options, &errptr);
+	if (errptr)
+		dbg("pcre_study: %s\n", errptr);
+	return 0;
+}
+
+static int status_filter_active(const struct status_filter *filter)
+{
+	return filter->nfrom || filter->grep;
+}
+
+static int status_filter_user(const struct status_filter *filter,
+			      const char *user)
+{
+	int i;
+
+	if (!filter->nfrom)
+		return 1;
+	for (i = 0; i < filter->nfrom; i++)
+		if (!strcasecmp(filter->from[i], user))
+			return 1;
+	return 0;
+}
+
+static int status_filter_text(const struct status_filter *filter,
+			      const char *text, size_t len)
+{
+	int ovector[3];
+
+	if (!filter->grep)
+		return 1;
+	if (filter->literal)
+		return memmem(text, len, filter->grep,
+			      strlen(filter->grep)) != NULL;
+	return pcre_exec(filter->re, filter->extra, text, len, 0, 0,
+			 ovector, 3) >= 0;
+}
+
+static void status_filter_free(struct status_filter *filter)
+{
+	int i;
+
+	for (i = 0; i < filter->nfrom; i++)
+		free(filter->from[i]);
+	free(filter->from);
+	free(filter->grep);
+	if (filter->extra)
+		pcre_free_study(filter->extra);
+	if (filter->re)
+		pcre_free(filter->re);
+}
+
+static void session_free(struct session *session)
+{
+	int i;
+
+	if (!session)
+		return;
+	for (i = 0; i < session->ntargets; i++) {
+		free(session->targets[i].hosturl);
+		free(session->targets[i].account);
+		free(session->targets[i].password);
+		if (session->targets[i].curl)
+			curl_easy_cleanup(session->targets[i].curl);
+	}
+	free(session->targets);
+	free(session->password);
+	free(session->account);
+	free(session->tweet);
+	free(session->proxy);
+	free(session->homedir);
+	free(session->logfile);
+	free(session->user);
+	free(session->hosturl);
+	free(session->actions);
+	free(session->batch);
+	free(session->shrinker);
+	free(session->query);
+	status_filter_free(&session->filter);
+	url_cache_close(session->url_cache);
+	status_store_close(session->store);
+	output_free(session->output);
+	log_close(session->log);
+	bti_curl_buffer_free(session->curl_buf);
+	if (session->curl)
+		curl_easy_cleanup(session->curl);
+	net_cache_close(session);
+	free(session);
+}
+
+enum status_field {
+	FIELD_NONE = 0,
+	FIELD_CREATED,
+	FIELD_TEXT,
+	FIELD_USER,
+	FIELD_ID,
+	FIELD_MAX
+};
+
+struct field_buffer {
+	char *data;
+	size_t length;
+	size_t size;
+	int seen;
+};
+
+/*
+ * Bump allocator for the statuses of one response.  Statuses are freed
+ * in the order they were allocated, so a chunk goes back as a whole as
+ * soon as the last status in it is gone, and whatever is left is
+ * released in one go when the response is done.
+ */
+#define ARENA_CHUNK_SIZE	(32 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used;
+	size_t size;
+	size_t live;
+	char data[];
+};
+
+struct arena {
+	struct arena_chunk *head;	/* the oldest */
+	struct arena_chunk *tail;	/* allocated from */
+	struct arena_chunk *spare;
+};
+
+static void *arena_alloc(struct arena *arena, size_t size,
+			 struct arena_chunk **chunk_out)
+{
+	struct arena_chunk *chunk = arena->tail;
+	void *ptr;
+
+	size = (size + 7) & ~(size_t)7;
+	if (!chunk || chunk->used + size > chunk->size) {
+		if (arena->spare && arena->spare->size >= size) {
+			chunk = arena->spare;
+			arena->spare = NULL;
+		} else {
+			chunk = malloc(sizeof(*chunk) +
+				       (size > ARENA_CHUNK_SIZE ? size :
+					ARENA_CHUNK_SIZE));
+			if (!chunk)
+				return NULL;
+			chunk->size = size > ARENA_CHUNK_SIZE ? size :
+				      ARENA_CHUNK_SIZE;
+		}
+		chunk->next = NULL;
+		chunk->used = 0;
+		chunk->live = 0;
+		if (arena->tail)
+			arena->tail->next = chunk;
+		else
+			arena->head = chunk;
+		arena->tail = chunk;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	chunk->live++;
+	*chunk_out = chunk;
+	return ptr;
+}
+
+/* Give back one allocation out of @chunk */
+static void arena_release(struct arena *arena, struct arena_chunk *chunk)
+{
+	struct arena_chunk **prev;
+
+	if (--chunk->live)
+		return;
+	if (chunk == arena->tail) {
+		chunk->used = 0;
+		return;
+	}
+
+	for (prev = &arena->head; *prev != chunk; prev = &(*prev)->next)
+		;
+	*prev = chunk->next;
+	if (!arena->spare && chunk->size == ARENA_CHUNK_SIZE)
+		arena->spare = chunk;
+	else
+		free(chunk);
+}
+
+static void arena_free(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	while ((chunk = arena->head)) {
+		arena->head = chunk->next;
+		free(chunk);
+	}
+	free(arena->spare);
+	memset(arena, 0, sizeof(*arena));
+}
+
+/*
+ * Screen names of a merge, so that the statuses of an author share one
+ * copy of the name.  Once the table is three quarters full every new
+ * name is kept with its status instead.
+ */
+#define NAME_TABLE_SLOTS	4096
+
+struct name_slot {
+	uint64_t hash;
+	const char *name;
+};
+
+struct name_table {
+	struct arena arena;
+	unsigned int count;
+	struct name_slot slots[NAME_TABLE_SLOTS];
+};
+
+static struct name_table *name_table_alloc(void)
+{
+	return zalloc(sizeof(struct name_table));
+}
+
+static void name_table_free(struct name_table *names)
+{
+	if (!names)
+		return;
+	arena_free(&names->arena);
+	free(names);
+}
+
+/* The shared copy of @name, NULL if it is not in the table and can't be */
+static const char *name_intern(struct name_table *names, const char *name,
+			       size_t len)
+{
+	uint64_t hash = hash_string(name, len) | 1;
+	struct arena_chunk *chunk;
+	struct name_slot *slot;
+	char *copy;
+	unsigned int i;
+
+	for (i = 0; i < NAME_TABLE_SLOTS; i++) {
+		slot = &names->slots[(hash + i) % NAME_TABLE_SLOTS];
+		if (!slot->hash)
+			break;
+		if (slot->hash == hash && !strcmp(slot->name, name))
+			return slot->name;
+	}
+	if (names->count >= NAME_TABLE_SLOTS / 4 * 3)
+		return NULL;
+
+	copy = arena_alloc(&names->arena, len + 1, &chunk);
+	if (!copy)
+		return NULL;
+	memcpy(copy, name, len + 1);
+	slot->hash = hash;
+	slot->name = copy;
+	names->count++;
+	return copy;
+}
+
+/*
+ * Statuses of one timeline of a merge, waiting for their turn to be
+ * printed.  Each one is a single allocation out of the arena of the
+ * queue, with the created_at, text and, unless it is interned, user
+ * strings following each other in data.
+ */
+struct queued_status {
+	struct queued_status *next;
+	struct arena_chunk *chunk;
+	unsigned long long id;
+	time_t created_time;
+	const char *created;
+	const char *user;
+	const char *text;
+	char data[];
+};
+
+/* statuses a merge queues per timeline before it stops reading it */
+#define MERGE_QUEUE_MAX		64
+
+struct status_queue {
+	struct queued_status *head;
+	struct queued_status *tail;
+	unsigned int count;
+	struct arena arena;
+	struct name_table *names;
+	int paused;
+	int done;
+	int in_heap;
+};
+
+/*
+ * Streaming timeline parser.  The response body is pushed into libxml2
+ * as it arrives from curl and every <status> is printed, and its fields
+ * recycled, as soon as its closing tag has been seen.  Nothing of the
+ * document is kept around, so memory stays flat no matter how large the
+ * timeline is.
+ */
+struct timeline_parser {
+	xmlParserCtxtPtr ctxt;
+	struct output *out;
+	int depth;
+	int in_status;
+	int in_user;
+	enum status_field field;
+	struct field_buffer fields[FIELD_MAX];
+	unsigned long long max_id;
+	unsigned int printed;
+	struct status_store *store;
+	uint32_t host;
+	unsigned int timeline;
+	struct status_queue *queue;	/* queue statuses instead of printing */
+	time_t since;
+	time_t until;
+	time_t created_time;	/* of the current status, if needed */
+	const struct status_filter *filter;
+	unsigned long long seen_id;	/* --follow showed up to this one */
+	int skip;		/* the current status is not shown */
+	int text_checked;	/* --grep has been tried on it already */
+	int error;
+	double parse_time;	/* without the time spent writing */
+};
+
+static int field_append(struct field_buffer *field, const char *data,
+			size_t len)
+{
+	char *temp;
+	size_t size;
+
+	if (field->length + len + 1 > field->size) {
+		size = field->size ? field->size : 64;
+		while (size < field->length + len + 1)
+			size *= 2;
+		temp = realloc(field->data, size);
+		if (!temp)
+			return -ENOMEM;
+		field->data = temp;
+		field->size = size;
+	}
+	memcpy(&field->data[field->length], data, len);
+	field->length += len;
+	field->data[field->length] = '\0';
+	return 0;
+}
+
+static void status_reset(struct timeline_parser *parser)
+{
+	int i;
+
+	for (i = 0; i < FIELD_MAX; i++) {
+		parser->fields[i].length = 0;
+		parser->fields[i].seen = 0;
+	}
+	parser->field = FIELD_NONE;
+	parser->created_time = 0;
+	parser->skip = 0;
+	parser->text_checked = 0;
+}
+
+/* Days from 1970-01-01 to a date of the proleptic Gregorian calendar */
+static long days_from_civil(int year, int month, int day)
+{
+	long era;
+	long yoe;
+	long doy;
+
+	year -= month <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/* The value of @count decimal digits at @str, -1 if they are not */
+static int parse_digits(const char *str, int count)
+{
+	int value = 0;
+
+	while (count--) {
+		if (*str < '0' || *str > '9')
+			return -1;
+		value = value * 10 + *str++ - '0';
+	}
+	return value;
+}
+
+/*
+ * Seconds since the epoch of a created_at, 0 if it makes no sense.  The
+ * API always sends them as "Wed Sep 10 08:53:20 +0000 2008", and this
+ * runs for every status, so the fields are read from where they have to
+ * be instead of going through strptime() and the locale.
+ */
+static time_t parse_created(const char *created, size_t len)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	int month;
+	int day;
+	int hour;
+	int minute;
+	int second;
+	int offset;
+	int year;
+
+	if (len < 30 || created[3] != ' ' || created[7] != ' ' ||
+	    created[13] != ':' || created[16] != ':' ||
+	    (created[20] != '+' && created[20] != '-'))
+		return 0;
+
+	for (month = 0; month < 12; month++)
+		if (!memcmp(created + 4, months + month * 3, 3))
+			break;
+	day = parse_digits(created + 8, 2);
+	hour = parse_digits(created + 11, 2);
+	minute = parse_digits(created + 14, 2);
+	second = parse_digits(created + 17, 2);
+	offset = parse_digits(created + 21, 4);
+	year = parse_digits(created + 26, 4);
+	if (month == 12 || day < 0 || hour < 0 || minute < 0 || second < 0 ||
+	    offset < 0 || year < 0)
+		return 0;
+
+	offset = (offset / 100 * 60 + offset % 100) * 60;
+	if (created[20] == '-')
+		offset = -offset;
+	return days_from_civil(year, month + 1, day) * 86400 + hour * 3600 +
+	       minute * 60 + second - offset;
+}
+
+/* Whether @created is inside the window of --since and --until */
+static int created_in_window(time_t created, time_t since, time_t until)
+{
+	return (!since || created >= since) && (!until || created < until);
+}
+
+static int status_queue_push(struct status_queue *queue,
+			     unsigned long long id, time_t created_time,
+			     const struct field_buffer *created,
+			     const struct field_buffer *user,
+			     const struct field_buffer *text)
+{
+	struct queued_status *status;
+	struct arena_chunk *chunk;
+	const char *name = NULL;
+	size_t size;
+	char *data;
+
+	if (queue->names)
+		name = name_intern(queue->names, user->data, user->length);
+	size = sizeof(*status) + created->length + text->length + 2;
+	if (!name)
+		size += user->length + 1;
+
+	status = arena_alloc(&queue->arena, size, &chunk);
+	if (!status)
+		return -ENOMEM;
+	status->next = NULL;
+	status->chunk = chunk;
+	status->id = id;
+	data = status->data;
+	status->created = memcpy(data, created->data, created->length + 1);
+	data += created->length + 1;
+	status->text = memcpy(data, text->data, text->length + 1);
+	data += text->length + 1;
+	status->user = name ? name : memcpy(data, user->data,
+					    user->length + 1);
+	status->created_time = created_time;
+
+	if (queue->tail)
+		queue->tail->next = status;
+	else
+		queue->head = status;
+	queue->tail = status;
+	queue->count++;
+	return 0;
+}
+
+/* Unlink the head of @queue, which goes back with status_queue_release() */
+static struct queued_status *status_queue_pop(struct status_queue *queue)
+{
+	struct queued_status *status = queue->head;
+
+	if (!status)
+		return NULL;
+	queue->head = status->next;
+	if (!queue->head)
+		queue->tail = NULL;
+	queue->count--;
+	return status;
+}
+
+static void status_queue_release(struct status_queue *queue,
+				 struct queued_status *status)
+{
+	arena_release(&queue->arena, status->chunk);
+}
+
+static void status_queue_clear(struct status_queue *queue)
+{
+	queue->head = NULL;
+	queue->tail = NULL;
+	queue->count = 0;
+	arena_free(&queue->arena);
+}
+
+static void print_status(struct timeline_parser *parser)
+{
+	const char *user = parser->fields[FIELD_USER].data;
+	const char *text = parser->fields[FIELD_TEXT].data;
+	const char *created = parser->fields[FIELD_CREATED].data;
+	unsigned long long id = 0;
+
+	if (parser->skip ||
+	    !parser->fields[FIELD_USER].seen ||
+	    !parser->fields[FIELD_TEXT].seen ||
+	    !parser->fields[FIELD_CREATED].seen)
+		return;
+	if (parser->filter && !parser->text_checked &&
+	    !status_filter_text(parser->filter, text,
+				parser->fields[FIELD_TEXT].length))
+		return;
+
+	if (parser->fields[FIELD_ID].seen)
+		id = strtoull(parser->fields[FIELD_ID].data, NULL, 10);
+
+	if (parser->queue) {
+		if (status_queue_push(parser->queue, id, parser->created_time,
+				      &parser->fields[FIELD_CREATED],
+				      &parser->fields[FIELD_USER],
+				      &parser->fields[FIELD_TEXT])) {
+			parser->error = 1;
+			xmlStopParser(parser->ctxt);
+			return;
+		}
+	} else {
+		output_status(parser->out, id, created, user, text);
+		parser->printed++;
+	}
+	if (parser->store && id)
+		status_store_append(parser->store, parser->host,
+				    parser->timeline, id, created, user, text);
+}
+
+/*
+ * The created_at of the current status is complete.  The time of it is
+ * only worked out when something needs it, and a status outside the
+ * window is skipped from here on, so that the rest of its fields are
+ * never collected.  The API sends created_at first.
+ */
+static void status_created(struct timeline_parser *parser)
+{
+	struct field_buffer *created = &parser->fields[FIELD_CREATED];
+
+	if (!parser->queue && !parser->since && !parser->until)
+		return;
+	parser->created_time = parse_created(created->data, created->length);
+	if (!created_in_window(parser->created_time, parser->since,
+			       parser->until))
+		parser->skip = 1;
+}
+
+/*
+ * The screen name or the text of the current status is complete.  The
+ * cheap --from is tried as soon as the screen name is there, and the
+ * text is only searched once the screen name has passed, or right away
+ * without --from.  A status that fails either is skipped from here on.
+ */
+static void status_user_done(struct timeline_parser *parser)
+{
+	if (parser->filter &&
+	    !status_filter_user(parser->filter,
+				parser->fields[FIELD_USER].data))
+		parser->skip = 1;
+}
+
+static void status_text_done(struct timeline_parser *parser)
+{
+	struct field_buffer *text = &parser->fields[FIELD_TEXT];
+
+	if (!parser->filter ||
+	    (parser->filter->nfrom && !parser->fields[FIELD_USER].seen))
+		return;
+	parser->text_checked = 1;
+	if (!status_filter_text(parser->filter, text->data, text->length))
+		parser->skip = 1;
+}
+
+/*
+ * The id of the current status is complete.  --follow asks the server
+ * for what is newer than the statuses it has shown already, but does
+ * not count on it: anything it has shown is skipped again here.
+ */
+static void status_id_done(struct timeline_parser *parser)
+{
+	if (parser->seen_id &&
+	    strtoull(parser->fields[FIELD_ID].data, NULL, 10) <=
+	    parser->seen_id)
+		parser->skip = 1;
+}
+
+/* Remember the newest status we have seen, for since_id */
+static void status_track_id(struct timeline_parser *parser)
+{
+	unsigned long long id;
+
+	if (!parser->fields[FIELD_ID].seen)
+		return;
+	id = strtoull(parser->fields[FIELD_ID].data, NULL, 10);
+	if (id > parser->max_id)
+		parser->max_id = id;
+}
+
+/*
+ * The elements of a timeline that the parser looks at.  No two of their
+ * names have the same length and first letter, so a switch on those
+ * leaves a single candidate, and one strcmp() tells whether it is that.
+ */
+enum timeline_element {
+	ELEMENT_OTHER = 0,
+	ELEMENT_STATUSES,
+	ELEMENT_STATUS,
+	ELEMENT_CREATED_AT,
+	ELEMENT_TEXT,
+	ELEMENT_ID,
+	ELEMENT_USER,
+	ELEMENT_SCREEN_NAME,
+};
+
+static enum timeline_element timeline_element(const xmlChar *name)
+{
+	const char *str = (const char *)name;
+	enum timeline_element element;
+	const char *expect;
+
+	switch (strlen(str)) {
+	case 2:
+		element = ELEMENT_ID;
+		expect = "id";
+		break;
+	case 4:
+		if (str[0] == 't') {
+			element = ELEMENT_TEXT;
+			expect = "text";
+		} else {
+			element = ELEMENT_USER;
+			expect = "user";
+		}
+		break;
+	case 6:
+		element = ELEMENT_STATUS;
+		expect = "status";
+		break;
+	case 8:
+		element = ELEMENT_STATUSES;
+		expect = "statuses";
+		break;
+	case 10:
+		element = ELEMENT_CREATED_AT;
+		expect = "created_at";
+		break;
+	case 11:
+		element = ELEMENT_SCREEN_NAME;
+		expect = "screen_name";
+		break;
+	default:
+		return ELEMENT_OTHER;
+	}
+	return strcmp(str, expect) ? ELEMENT_OTHER : element;
+}
+
+static void timeline_start_element(void *ctx, const xmlChar *name,
+				   const xmlChar *prefix, const xmlChar *uri,
+				   int nb_namespaces,
+				   const xmlChar **namespaces,
+				   int nb_attributes, int nb_defaulted,
+				   const xmlChar **attributes)
+{
+	struct timeline_parser *parser = ctx;
+	enum status_field field = FIELD_NONE;
+
+	parser->depth++;
+
+	switch (parser->depth) {
+	case 1:
+		if (timeline_element(name) != ELEMENT_STATUSES) {
+			fprintf(stderr, "unexpected document type\n");
+			parser->error = 1;
+			xmlStopParser(parser->ctxt);
+		}
+		break;
+	case 2:
+		if (timeline_element(name) == ELEMENT_STATUS) {
+			parser->in_status = 1;
+			status_reset(parser);
+		}
+		break;
+	case 3:
+		if (!parser->in_status)
+			break;
+		switch (timeline_element(name)) {
+		case ELEMENT_CREATED_AT:
+			field = FIELD_CREATED;
+			break;
+		case ELEMENT_TEXT:
+			field = FIELD_TEXT;
+			break;
+		case ELEMENT_ID:
+			field = FIELD_ID;
+			break;
+		case ELEMENT_USER:
+			parser->in_user = 1;
+			break;
+		default:
+			break;
+		}
+		break;
+	case 4:
+		if (parser->in_user &&
+		    timeline_element(name) == ELEMENT_SCREEN_NAME)
+			field = FIELD_USER;
+		break;
+	default:
+		break;
+	}
+
+	/* of a status that is not shown only the id is still needed */
+	if (parser->skip && field != FIELD_ID)
+		field = FIELD_NONE;
+
+	parser->field = field;
+	if (field != FIELD_NONE) {
+		/* the last occurrence of a field wins */
+		parser->fields[field].length = 0;
+		parser->fields[field].seen = 1;
+		if (field_append(&parser->fields[field], "", 0)) {
+			parser->error = 1;
+			xmlStopParser(parser->ctxt);
+		}
+	}
+}
+
+static void timeline_end_element(void *ctx, const xmlChar *name,
+				 const xmlChar *prefix, const xmlChar *uri)
+{
+	struct timeline_parser *parser = ctx;
+	enum status_field field = parser->field;
+
+	parser->field = FIELD_NONE;
+
+	switch (parser->depth) {
+	case 2:
+		if (parser->in_status) {
+			print_status(parser);
+			status_track_id(parser);
+		}
+		parser->in_status = 0;
+		break;
+	case 3:
+		parser->in_user = 0;
+		if (field == FIELD_CREATED)
+			status_created(parser);
+		else if (field == FIELD_TEXT)
+			status_text_done(parser);
+		else if (field == FIELD_ID)
+			status_id_done(parser);
+		break;
+	case 4:
+		if (field == FIELD_USER)
+			status_user_done(parser);
+		break;
+	default:
+		break;
+	}
+
+	parser->depth--;
+}
+
+static void timeline_characters(void *ctx, const xmlChar *ch, int len)
+{
+	struct timeline_parser *parser = ctx;
+
+	if (parser->field == FIELD_NONE)
+		return;
+
+	if (field_append(&parser->fields[parser->field],
+			 (const char *)ch, len)) {
+		parser->error = 1;
+		xmlStopParser(parser->ctxt);
+	}
+}
+
+static void timeline_parser_free(struct timeline_parser *parser)
+{
+	int i;
+
+	if (!parser)
+		return;
+	if (parser->ctxt)
+		xmlFreeParserCtxt(parser->ctxt);
+	for (i = 0; i < FIELD_MAX; i++)
+		free(parser->fields[i].data);
+	free(parser);
+}
+
+static struct timeline_parser *timeline_parser_alloc(struct session *session,
+						    struct output *out)
+{
+	static xmlSAXHandler sax = {
+		.initialized	= XML_SAX2_MAGIC,
+		.startElementNs	= timeline_start_element,
+		.endElementNs	= timeline_end_element,
+		.characters	= timeline_characters,
+		.cdataBlock	= timeline_characters,
+	};
+	struct timeline_parser *parser;
+
+	parser = zalloc(sizeof(*parser));
+	if (!parser)
+		return NULL;
+	parser->out = out;
+	parser->since = session->since;
+	parser->until = session->until;
+	if (status_filter_active(&session->filter))
+		parser->filter = &session->filter;
+	if (session->follow)
+		parser->seen_id = session->since_id;
+	if (session->store) {
+		parser->store = session->store;
+		parser->host = status_host(session->hosturl);
+		parser->timeline = session->action;
+	}
+
+	parser->ctxt = xmlCreatePushParserCtxt(&sax, parser, NULL, 0,
+					       "timeline.xml");
+	if (!parser->ctxt) {
+		free(parser);
+		return NULL;
+	}
+	xmlCtxtUseOptions(parser->ctxt, XML_PARSE_NOERROR |
+			  XML_PARSE_NOWARNING | XML_PARSE_NONET);
+	return parser;
+}
+
+static int timeline_parser_feed(struct timeline_parser *parser,
+				const char *data, size_t len, int terminate)
+{
+	double start;
+	double written;
+
+	if (parser->error)
+		return -EINVAL;
+	start = monotonic_time();
+	written = parser->out->write_time;
+	xmlParseChunk(parser->ctxt, data, len, terminate);
+	parser->parse_time += monotonic_time() - start -
+			      (parser->out->write_time - written);
+	return parser->error ? -EINVAL : 0;
+}
+
+static size_t curl_callback(void *buffer, size_t size, size_t nmemb,
+			    void *userp)
+{
+	struct bti_curl_buffer *curl_buf = userp;
+	size_t buffer_size = size * nmemb;
+
+	if ((!buffer) || (!buffer_size) || (!curl_buf))
+		return -EINVAL;
+
+	/*
+	 * A merge that is behind on this timeline stops reading it, curl
+	 * hands the same data in again once it is resumed.
+	 */
+	if (curl_buf->parser && curl_buf->parser->queue &&
+	    curl_buf->parser->queue->count >= MERGE_QUEUE_MAX) {
+		curl_buf->parser->queue->paused = 1;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	dbg("%.*s\n", (int)buffer_size, (char *)buffer);
+
+	curl_buf->bytes_received += buffer_size;
+
+	/* timelines are parsed as they arrive, nothing is kept around */
+	if (curl_buf->parser) {
+		if (timeline_parser_feed(curl_buf->parser, buffer,
+					 buffer_size, 0))
+			return -EINVAL;
+		return buffer_size;
+	}
+
+	if (curl_buf->max_size &&
+	    curl_buf->length + buffer_size > curl_buf->max_size) {
+		curl_buf->overflow = 1;
+		return 0;
+	}
+
+	if (bti_curl_buffer_append(curl_buf, buffer, buffer_size))
+		return -ENOMEM;
+
+	return buffer_size;
+}
+
+/* Pick the cache validators out of the response headers */
+static size_t curl_header_callback(char *buffer, size_t size, size_t nitems,
+				   void *userp)
+{
+	struct bti_curl_buffer *curl_buf = userp;
+	size_t len = size * nitems;
+	char **field;
+	size_t skip;
+
+	if (len > 5 && !strncasecmp(buffer, "ETag:", 5)) {
+		field = &curl_buf->etag;
+		skip = 5;
+	} else if (len > 14 && !strncasecmp(buffer, "Last-Modified:", 14)) {
+		field = &curl_buf->last_modified;
+		skip = 14;
+	} else {
+		return len;
+	}
+
+	while (skip < len && isspace((unsigned char)buffer[skip]))
+		skip++;
+	while (len > skip && isspace((unsigned char)buffer[len - 1]))
+		len--;
+	free(*field);
+	*field = strndup(buffer + skip, len - skip);
+	return size * nitems;
+}
+
+/*
+ * Everything curl needs to keep pointing at while a request is in
+ * flight.  One of these per transfer lets several run at the same time.
+ */
+struct request {
+	char endpoint[512];
+	char user_password[500];
+	struct curl_httppost *formpost;
+	struct curl_slist *slist;
+	size_t endpoint_len;	/* without the since_id */
+	int validated;		/* validators are sent and kept */
+	int conditional;
+};
+
+static const char validators_file[] = ".bti_validators";
+
+/*
+ * Whether --since, --until, --from or --grep leave some statuses out of
+ * this run.  The statuses left out were never shown, so such a run does
+ * not move the since_id or the validators on past them; the next run
+ * without them reads them again.
+ */
+static int session_filtered(struct session *session)
+{
+	return session->since || session->until ||
+	       status_filter_active(&session->filter);
+}
+
+/*
+ * Validators are kept per account and url, tab separated.  The since_id
+ * is left out of the url, or every new status would add another entry.
+ */
+static void validator_key(struct session *session, struct request *req,
+			  char *key, size_t size)
+{
+	snprintf(key, size, "%s\t%.*s\t",
+		 session->account ? session->account : "",
+		 (int)req->endpoint_len, req->endpoint);
+}
+
+/*
+ * Make the request for a timeline we fetched before conditional, so the
+ * server can answer 304 if nothing changed.
+ */
+static void validator_apply(struct session *session, CURL *curl,
+			    struct request *req)
+{
+	char key[1024];
+	char header[512];
+	char *value;
+	char *modified;
+
+	validator_key(session, req, key, sizeof(key));
+	value = state_load(session, validators_file, key);
+	if (!value)
+		return;
+	modified = strchr(value, '\t');
+	if (modified)
+		*modified++ = '\0';
+
+	if (value[0]) {
+		snprintf(header, sizeof(header), "If-None-Match: %s", value);
+		req->slist = curl_slist_append(req->slist, header);
+	}
+	if (modified && modified[0]) {
+		snprintf(header, sizeof(header), "If-Modified-Since: %s",
+			 modified);
+		req->slist = curl_slist_append(req->slist, header);
+	}
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->slist);
+	req->conditional = 1;
+	free(value);
+}
+
+static void validator_save(struct session *session, struct request *req,
+			   struct bti_curl_buffer *curl_buf)
+{
+	char key[1024];
+	char *value;
+
+	if (!curl_buf->etag && !curl_buf->last_modified)
+		return;
+	if (session_filtered(session))
+		return;
+
+	validator_key(session, req, key, sizeof(key));
+	value = alloca((curl_buf->etag ? strlen(curl_buf->etag) : 0) +
+		       (curl_buf->last_modified ?
+			strlen(curl_buf->last_modified) : 0) + 2);
+	sprintf(value, "%s\t%s", curl_buf->etag ? curl_buf->etag : "",
+		curl_buf->last_modified ? curl_buf->last_modified : "");
+	state_store(session, validators_file, key, value, NULL);
+}
+
+/* One of the timelines that a merge reads from */
+struct timeline_source {
+	enum action action;
+	const char *user;
+};
+
+/*
+ * Point @curl at the request for the session's action.  @target, if
+ * set, replaces the host and credentials of the session, and @source
+ * the action and user.
+ */
+static void request_setup(struct session *session,
+			  const struct target *target,
+			  const struct timeline_source *source, CURL *curl,
+			  struct request *req, int page)
+{
+	char data[500];
+	struct curl_httppost *lastptr = NULL;
+	const char *hosturl = session->hosturl;
+	const char *account = session->account;
+	const char *password = session->password;
+	enum action action = session->action;
+	const char *user = session->user;
+
+	if (target) {
+		hosturl = target->hosturl;
+		if (target->account)
+			account = target->account;
+		if (target->password)
+			password = target->password;
+	}
+
+	if (source) {
+		action = source->action;
+		user = source->user;
+	}
+
+	memset(req, 0, sizeof(*req));
+
+	switch (action) {
+	case ACTION_UPDATE:
+		snprintf(req->user_password, sizeof(req->user_password),
+			 "%s:%s", account, password);
+		snprintf(data, sizeof(data), "status=\"%s\"", session->tweet);
+		curl_formadd(&req->formpost, &lastptr,
+			     CURLFORM_COPYNAME, "status",
+			     CURLFORM_COPYCONTENTS, session->tweet,
+			     CURLFORM_END);
+
+		curl_formadd(&req->formpost, &lastptr,
+			     CURLFORM_COPYNAME, "source",
+			     CURLFORM_COPYCONTENTS, "bti",
+			     CURLFORM_END);
+
+		curl_easy_setopt(curl, CURLOPT_HTTPPOST, req->formpost);
+		req->slist = curl_slist_append(req->slist, "Expect:");
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->slist);
+
+		snprintf(req->endpoint, sizeof(req->endpoint), "%s%s",
+			 hosturl, update_uri);
+		curl_easy_setopt(curl, CURLOPT_URL, req->endpoint);
+		curl_easy_setopt(curl, CURLOPT_USERPWD, req->user_password);
+
+		dbg("data = %s\n", data);
+		break;
+	case ACTION_FRIENDS:
+		snprintf(req->user_password, sizeof(req->user_password),
+			 "%s:%s", account, password);
+		snprintf(req->endpoint, sizeof(req->endpoint), "%s%s?page=%d",
+			 hosturl, friends_uri, page);
+		curl_easy_setopt(curl, CURLOPT_URL, req->endpoint);
+		curl_easy_setopt(curl, CURLOPT_USERPWD, req->user_password);
+
+		break;
+	case ACTION_USER:
+		snprintf(req->endpoint, sizeof(req->endpoint),
+			 "%s%s%s.xml?page=%d", hosturl, user_uri, user, page);
+		curl_easy_setopt(curl, CURLOPT_URL, req->endpoint);
+
+		break;
+	case ACTION_REPLIES:
+		snprintf(req->user_password, sizeof(req->user_password),
+			 "%s:%s", account, password);
+		snprintf(req->endpoint, sizeof(req->endpoint), "%s%s?page=%d",
+			 hosturl, replies_uri, page);
+		curl_easy_setopt(curl, CURLOPT_URL, req->endpoint);
+		curl_easy_setopt(curl, CURLOPT_USERPWD, req->user_password);
+
+		break;
+	case ACTION_PUBLIC:
+		snprintf(req->endpoint, sizeof(req->endpoint), "%s%s?page=%d",
+			 hosturl, public_uri, page);
+		curl_easy_setopt(curl, CURLOPT_URL, req->endpoint);
+
+		break;
+	default:
+		break;
+	}
+
+	/* only ask for what is newer than what we have already seen */
+	req->endpoint_len = strlen(req->endpoint);
+	if (action != ACTION_UPDATE && session->since_id) {
+		size_t len = strlen(req->endpoint);
+
+		snprintf(req->endpoint + len, sizeof(req->endpoint) - len,
+			 "&since_id=%llu", session->since_id);
+		curl_easy_setopt(curl, CURLOPT_URL, req->endpoint);
+	}
+
+	/*
+	 * Not for the timelines of a merge: a 304 for one of them would
+	 * leave it out of the merge altogether.
+	 */
+	if ((session->incremental || session->follow) &&
+	    action != ACTION_UPDATE && !source) {
+		req->validated = 1;
+		validator_apply(session, curl, req);
+	}
+
+	/* let curl ask for gzip or deflate and inflate as the data arrives */
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
+	if (session->proxy)
+		curl_easy_setopt(curl, CURLOPT_PROXY, session->proxy);
+
+	if (debug)
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+
+	dbg("user_password = %s\n", req->user_password);
+	dbg("proxy = %s\n", session->proxy);
+}
+
+/*
+ * Add the phases and the bytes of a finished transfer to the --stats
+ * times.  curl reports each of them as the time from the start of the
+ * transfer, and the ones that did not happen on a reused connection as
+ * zero.
+ */
+static void stats_transfer(struct session *session, CURL *curl)
+{
+	struct run_stats *times = &session->times;
+	double lookup = 0;
+	double connect = 0;
+	double tls = 0;
+	double pretransfer = 0;
+	double first_byte = 0;
+	double total = 0;
+	curl_off_t sent = 0;
+	curl_off_t received = 0;
+	long request = 0;
+	long headers = 0;
+
+	curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &sent);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+	curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &request);
+	curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &headers);
+	times->bytes += sent + received + request + headers;
+
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &lookup);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &tls);
+	curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &first_byte);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+
+	times->transfers++;
+	times->dns += lookup;
+	if (connect > lookup)
+		times->connect += connect - lookup;
+	if (tls > connect)
+		times->tls += tls - connect;
+	if (first_byte > pretransfer)
+		times->server += first_byte - pretransfer;
+	if (total > first_byte)
+		times->transfer += total - first_byte;
+}
+
+/*
+ * Wrap up a timeline transfer that went through.  A 304 means that
+ * there is nothing new and the parse is skipped entirely.
+ */
+static int timeline_finish(struct session *session, struct request *req,
+			   CURL *curl, struct bti_curl_buffer *curl_buf)
+{
+	curl_off_t wire = 0;
+	long headers = 0;
+	long code = 0;
+
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wire);
+	curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &headers);
+	session->wire_bytes += wire + headers;
+	session->body_bytes += curl_buf->bytes_received;
+	session->requests++;
+	if (req->conditional)
+		session->conditional++;
+	if (code == 304) {
+		session->not_modified++;
+		dbg("%s not modified\n", req->endpoint);
+		return 0;
+	}
+
+	/* flush whatever libxml2 still holds on to */
+	if (timeline_parser_feed(curl_buf->parser, NULL, 0, 1))
+		return -EINVAL;
+	if (curl_buf->parser->max_id > session->max_id)
+		session->max_id = curl_buf->parser->max_id;
+	session->statuses += curl_buf->parser->printed;
+	session->times.parse += curl_buf->parser->parse_time;
+	if (req->validated && code == 200)
+		validator_save(session, req, curl_buf);
+	return 0;
+}
+
+static void request_cleanup(struct request *req)
+{
+	curl_formfree(req->formpost);
+	curl_slist_free_all(req->slist);
+	req->formpost = NULL;
+	req->slist = NULL;
+}
+
+static int send_request(struct session *session)
+{
+	struct request req;
+	struct bti_curl_buffer *curl_buf;
+	CURL *curl = NULL;
+	CURLcode res;
+	long code = 0;
+	int retval = 0;
+
+	if (!session)
+		return -EINVAL;
+
+	if (!session->curl_buf) {
+		session->curl_buf = bti_curl_buffer_alloc(session->max_body);
+		if (!session->curl_buf)
+			return -ENOMEM;
+	}
+	curl_buf = session->curl_buf;
+	bti_curl_buffer_reset(curl_buf, session->action);
+
+	if (session->action != ACTION_UPDATE) {
+		curl_buf->parser = timeline_parser_alloc(session,
+							 session->output);
+		if (!curl_buf->parser)
+			return -ENOMEM;
+	}
+
+	curl = curl_reuse(session, &session->curl);
+	if (!curl) {
+		timeline_parser_free(curl_buf->parser);
+		curl_buf->parser = NULL;
+		return -EINVAL;
+	}
+
+	request_setup(session, NULL, NULL, curl, &req, session->page);
+
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_callback);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, curl_buf);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header_callback);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, curl_buf);
+	if (!session->dry_run) {
+		res = curl_easy_perform(curl);
+		if (res == CURLE_COULDNT_CONNECT &&
+		    dns_cache_forget(session, curl))
+			res = curl_easy_perform(curl);
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		stats_transfer(session, curl);
+		if (!res)
+			dns_cache_learn(session, curl);
+		if (res && !session->bash) {
+			if (curl_buf->overflow)
+				fprintf(stderr, "response larger than %zu "
+					"bytes, aborted\n", curl_buf->max_size);
+			else
+				fprintf(stderr, "error(%d) trying to perform "
+					"operation\n", res);
+			retval = -EINVAL;
+		} else if (!res && code >= 400) {
+			if (!session->bash)
+				fprintf(stderr, "server returned http %ld\n",
+					code);
+			retval = -EINVAL;
+		} else if (curl_buf->parser) {
+			timeline_finish(session, &req, curl, curl_buf);
+		}
+	}
+	bti_curl_buffer_stats(curl_buf, curl);
+
+	request_cleanup(&req);
+	timeline_parser_free(curl_buf->parser);
+	curl_buf->parser = NULL;
+	return retval;
+}
+
+/*
+ * A transfer driven by multi_perform().  complete() is called from the
+ * loop as soon as the transfer is over, with result filled in.
+ */
+struct multi_job {
+	CURL *curl;
+	CURLcode result;
+	int done;
+	void (*complete)(struct multi_job *job);
+};
+
+/*
+ * Run all @count jobs through one multi handle, keeping at most
+ * @max_jobs of them in flight.  @progress, if set, is called every time
+ * around the loop so the caller can consume results as they come in.
+ */
+static int multi_perform(struct multi_job **jobs, int count, int max_jobs,
+			 void (*progress)(void *data), void *data)
+{
+	struct multi_job *job;
+	CURLM *multi;
+	CURLMsg *msg;
+	int running = 0;
+	int active = 0;
+	int next = 0;
+	int left;
+
+	multi = curl_multi_init();
+	if (!multi)
+		return -ENOMEM;
+
+	if (max_jobs < 1)
+		max_jobs = 1;
+
+	while (next < count || active) {
+		while (active < max_jobs && next < count) {
+			job = jobs[next++];
+			curl_easy_setopt(job->curl, CURLOPT_PRIVATE, job);
+			curl_multi_add_handle(multi, job->curl);
+			active++;
+		}
+
+		curl_multi_perform(multi, &running);
+
+		while ((msg = curl_multi_info_read(multi, &left))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+					  (char **)&job);
+			job->result = msg->data.result;
+			job->done = 1;
+			curl_multi_remove_handle(multi, job->curl);
+			active--;
+			if (job->complete)
+				job->complete(job);
+		}
+
+		if (progress)
+			progress(data);
+
+		if (running)
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+	}
+
+	curl_multi_cleanup(multi);
+	return 0;
+}
+
+/*
+ * One page of a --pages range.  Pages are fetched concurrently but have
+ * to come out in order, so each one parses into its own memory stream
+ * until every page before it has been printed.  From then on it prints
+ * straight to stdout.
+ */
+struct page_fetch {
+	struct multi_job job;
+	struct session *session;
+	struct request req;
+	struct bti_curl_buffer *curl_buf;
+	int page;
+	struct output *out;
+};
+
+struct page_range {
+	struct page_fetch *pages;
+	int count;
+	int head;
+};
+
+static void page_complete(struct multi_job *job)
+{
+	struct page_fetch *fetch = container_of(job, struct page_fetch, job);
+	struct bti_curl_buffer *curl_buf = fetch->curl_buf;
+
+	stats_transfer(fetch->session, job->curl);
+	if (job->result) {
+		fprintf(stderr, "error(%d) trying to fetch page %d\n",
+			job->result, fetch->page);
+		if (job->result == CURLE_COULDNT_CONNECT)
+			dns_cache_forget(fetch->session, job->curl);
+	} else {
+		dns_cache_learn(fetch->session, job->curl);
+		timeline_finish(fetch->session, &fetch->req, job->curl,
+				curl_buf);
+	}
+
+	bti_curl_buffer_stats(curl_buf, job->curl);
+	timeline_parser_free(curl_buf->parser);
+	curl_buf->parser = NULL;
+	request_cleanup(&fetch->req);
+}
+
+/* Print what the pages at the head of the range have produced so far */
+static void page_range_flush(void *data)
+{
+	struct page_range *range = data;
+	struct page_fetch *fetch;
+
+	while (range->head < range->count) {
+		fetch = &range->pages[range->head];
+		if (fetch->out) {
+			output_append(fetch->session->output,
+				      fetch->out->data, fetch->out->length);
+			output_free(fetch->out);
+			fetch->out = NULL;
+			if (fetch->curl_buf->parser)
+				fetch->curl_buf->parser->out =
+					fetch->session->output;
+		}
+		if (!fetch->job.done)
+			break;
+		range->head++;
+	}
+	output_flush(range->pages[0].session->output);
+}
+
+static int fetch_pages(struct session *session)
+{
+	struct page_range range = { };
+	struct multi_job **jobs;
+	struct page_fetch *fetch;
+	int retval = 0;
+	int i;
+
+	range.count = session->last_page - session->page + 1;
+	range.pages = zalloc(range.count * sizeof(*range.pages));
+	jobs = zalloc(range.count * sizeof(*jobs));
+	if (!range.pages || !jobs) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+
+	for (i = 0; i < range.count; i++) {
+		fetch = &range.pages[i];
+		fetch->session = session;
+		fetch->page = session->page + i;
+		fetch->out = output_alloc(-1, session->format);
+		fetch->curl_buf = bti_curl_buffer_alloc(session->max_body);
+		fetch->job.curl = curl_init(session);
+		if (!fetch->out || !fetch->curl_buf || !fetch->job.curl) {
+			retval = -ENOMEM;
+			goto exit;
+		}
+		bti_curl_buffer_reset(fetch->curl_buf, session->action);
+		fetch->curl_buf->parser = timeline_parser_alloc(session,
+								fetch->out);
+		if (!fetch->curl_buf->parser) {
+			retval = -ENOMEM;
+			goto exit;
+		}
+
+		request_setup(session, NULL, NULL, fetch->job.curl,
+			      &fetch->req, fetch->page);
+		curl_easy_setopt(fetch->job.curl, CURLOPT_WRITEFUNCTION,
+				 curl_callback);
+		curl_easy_setopt(fetch->job.curl, CURLOPT_WRITEDATA,
+				 fetch->curl_buf);
+		curl_easy_setopt(fetch->job.curl, CURLOPT_HEADERFUNCTION,
+				 curl_header_callback);
+		curl_easy_setopt(fetch->job.curl, CURLOPT_HEADERDATA,
+				 fetch->curl_buf);
+		fetch->job.complete = page_complete;
+		jobs[i] = &fetch->job;
+	}
+
+	if (!session->dry_run)
+		retval = multi_perform(jobs, range.count, session->jobs,
+				       page_range_flush, &range);
+
+	for (i = 0; i < range.count; i++)
+		if (range.pages[i].job.result)
+			retval = -EINVAL;
+
+exit:
+	for (i = 0; range.pages && i < range.count; i++) {
+		fetch = &range.pages[i];
+		output_free(fetch->out);
+		if (fetch->curl_buf)
+			timeline_parser_free(fetch->curl_buf->parser);
+		bti_curl_buffer_free(fetch->curl_buf);
+		request_cleanup(&fetch->req);
+		if (fetch->job.curl)
+			curl_easy_cleanup(fetch->job.curl);
+	}
+	free(range.pages);
+	free(jobs);
+	return retval;
+}
+
+static int status_record_cmp(const void *a, const void *b)
+{
+	const struct status_record *ra = *(const struct status_record **)a;
+	const struct status_record *rb = *(const struct status_record **)b;
+
+	/* newest first, like the server does */
+	if (ra->id == rb->id)
+		return 0;
+	return ra->id < rb->id ? 1 : -1;
+}
+
+#define STATUS_PAGE_SIZE	20
+
+/* Print the requested pages of @match, newest first */
+static void print_records(struct session *session,
+			  const struct status_record **match, size_t count)
+{
+	const struct status_record *rec;
+	size_t first;
+	size_t last;
+
+	qsort(match, count, sizeof(*match), status_record_cmp);
+
+	first = (size_t)(session->page - 1) * STATUS_PAGE_SIZE;
+	last = (size_t)(session->last_page > session->page ?
+			session->last_page : session->page) * STATUS_PAGE_SIZE;
+	for (; first < count && first < last; first++) {
+		rec = match[first];
+		output_status(session->output, rec->id,
+			      status_record_created(rec),
+			      status_record_user(rec), status_record_text(rec));
+	}
+}
+
+/*
+ * Answer a timeline query from the local store.  The log is mapped and
+ * scanned front to back once, and the matching records are printed
+ * straight out of the mapping.
+ */
+static int query_store(struct session *session)
+{
+	const struct status_record **match = NULL;
+	const struct status_record *rec;
+	size_t count = 0;
+	size_t size = 0;
+	size_t offset;
+	struct stat st;
+	uint32_t host = status_host(session->hosturl);
+	char *file;
+	char *log;
+	int fd;
+	int retval = 0;
+
+	file = alloca(strlen(session->homedir) +
+		      strlen(status_store_file) + 2);
+	sprintf(file, "%s/%s", session->homedir, status_store_file);
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		/* nothing fetched yet, so nothing to show */
+		return errno == ENOENT ? 0 : -errno;
+	}
+	/* records are only appended, so a snapshot of the size will do */
+	flock(fd, LOCK_SH);
+	retval = fstat(fd, &st) < 0 ? -errno : 0;
+	flock(fd, LOCK_UN);
+	if (retval || st.st_size <= 8)
+		goto exit_close;
+
+	log = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (log == MAP_FAILED) {
+		retval = -errno;
+		goto exit_close;
+	}
+	madvise(log, st.st_size, MADV_SEQUENTIAL);
+
+	offset = sizeof(STATUS_LOG_MAGIC) - 1;
+	while ((rec = status_record_at(log, st.st_size, offset))) {
+		offset += rec->length;
+		if (rec->host != host)
+			continue;
+		if (session->action == ACTION_USER) {
+			if (strcmp(status_record_user(rec), session->user))
+				continue;
+		} else if (!(rec->timelines & session->action)) {
+			continue;
+		}
+		if ((session->since || session->until) &&
+		    !created_in_window(parse_created(status_record_created(rec),
+						     rec->created_len),
+				       session->since, session->until))
+			continue;
+		if (!status_filter_user(&session->filter,
+					status_record_user(rec)) ||
+		    !status_filter_text(&session->filter,
+					status_record_text(rec),
+					rec->text_len))
+			continue;
+		if (count == size) {
+			const struct status_record **temp;
+
+			size = size ? size * 2 : 256;
+			temp = realloc(match, size * sizeof(*match));
+			if (!temp) {
+				retval = -ENOMEM;
+				goto exit_unmap;
+			}
+			match = temp;
+		}
+		match[count++] = rec;
+	}
+	print_records(session, match, count);
+
+exit_unmap:
+	free(match);
+	munmap(log, st.st_size);
+exit_close:
+	close(fd);
+	return retval;
+}
+
+struct search_word {
+	char term[SEARCH_TERM_MAX];
+	size_t len;
+	int phrase;		/* words of a "quoted phrase" share a number */
+};
+
+/*
+ * Split @query into words.  Anything in double quotes is a phrase whose
+ * words have to follow each other, all other words just have to be
+ * there somewhere.
+ */
+static size_t search_parse(const char *query, struct search_word **words)
+{
+	struct search_word *temp;
+	struct search_word *word;
+	char term[SEARCH_TERM_MAX];
+	const char *end;
+	const char *p;
+	size_t count = 0;
+	size_t len;
+	int quoted = 0;
+	int phrase = 0;
+
+	*words = NULL;
+	while (*query) {
+		end = strchr(query, '"');
+		if (!end)
+			end = query + strlen(query);
+		p = query;
+		while (p < end && (len = search_token(&p, term))) {
+			/* search_token stops at the NUL, not at the quote */
+			if (p > end)
+				break;
+			temp = realloc(*words, (count + 1) * sizeof(*temp));
+			if (!temp)
+				break;
+			*words = temp;
+			word = &temp[count++];
+			memcpy(word->term, term, len);
+			word->len = len;
+			word->phrase = quoted ? phrase : -1;
+		}
+		if (!*end)
+			break;
+		if (!quoted)
+			phrase++;
+		quoted = !quoted;
+		query = end + 1;
+	}
+	return count;
+}
+
+/* Does @text contain the words of @phrase, one after the other? */
+static int search_phrase(const char *text, const struct search_word *words,
+			 size_t count, int phrase)
+{
+	char term[SEARCH_TERM_MAX];
+	const char *p = text;
+	const char *q;
+	size_t first = 0;
+	size_t len;
+	size_t i;
+
+	while (first < count && words[first].phrase != phrase)
+		first++;
+
+	while ((len = search_token(&p, term))) {
+		q = p;
+		for (i = first; i < count && words[i].phrase == phrase; i++) {
+			if (len != words[i].len ||
+			    memcmp(term, words[i].term, len))
+				break;
+			len = search_token(&q, term);
+		}
+		if (i == count || words[i].phrase != phrase)
+			return 1;
+	}
+	return 0;
+}
+
+/* Decode the postings of @word from every segment into @offsets */
+static size_t search_postings(const char *map, size_t size,
+			      const struct search_word *word,
+			      uint64_t **offsets)
+{
+	const struct search_segment *seg;
+	const struct search_term *terms;
+	const unsigned char *p;
+	const unsigned char *end;
+	uint64_t *temp;
+	uint64_t offset;
+	uint64_t delta;
+	size_t count = 0;
+	size_t pos = 0;
+	size_t lo, hi, mid;
+	uint32_t i;
+	int cmp;
+
+	*offsets = NULL;
+	while ((seg = search_segment_at(map, size, pos))) {
+		terms = (const struct search_term *)(seg + 1);
+		lo = 0;
+		hi = seg->nterms;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			cmp = search_term_cmp((const char *)seg +
+					      terms[mid].term,
+					      terms[mid].term_len,
+					      word->term, word->len);
+			if (!cmp)
+				break;
+			if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		pos += seg->length;
+		if (lo >= hi)
+			continue;
+
+		temp = realloc(*offsets,
+			       (count + terms[mid].count) * sizeof(*temp));
+		if (!temp)
+			break;
+		*offsets = temp;
+		p = (const unsigned char *)seg + terms[mid].postings;
+		end = p + terms[mid].postings_len;
+		offset = 0;
+		for (i = 0; i < terms[mid].count; i++) {
+			p = search_varint_read(p, end, &delta);
+			if (!p)
+				break;
+			offset += delta * 8;
+			(*offsets)[count++] = offset;
+		}
+	}
+	return count;
+}
+
+/* Keep the offsets of @a that are in @b as well, both are sorted */
+static size_t search_intersect(uint64_t *a, size_t na, const uint64_t *b,
+			       size_t nb)
+{
+	size_t i = 0, j = 0, n = 0;
+
+	while (i < na && j < nb) {
+		if (a[i] < b[j])
+			i++;
+		else if (a[i] > b[j])
+			j++;
+		else {
+			a[n++] = a[i++];
+			j++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Answer a search from the full text index.  The posting lists of the
+ * words are intersected and phrases are then checked against the text
+ * of the few statuses that are left.
+ */
+static int search_store(struct session *session)
+{
+	const struct status_record **match = NULL;
+	const struct status_record *rec;
+	struct search_word *words = NULL;
+	uint64_t *offsets = NULL;
+	uint64_t *other;
+	size_t nwords;
+	size_t noffsets = 0;
+	size_t nother;
+	size_t count = 0;
+	size_t log_size = 0;
+	struct stat st = { };
+	uint32_t host = status_host(session->hosturl);
+	char *map = NULL;
+	char *log = NULL;
+	char *file;
+	size_t i;
+	int phrases = 0;
+	int phrase;
+	int fd = -1;
+	int retval;
+
+	if (!session->store)
+		return -EINVAL;
+	retval = search_index_update(session->store, session->homedir);
+	if (retval)
+		return retval;
+
+	nwords = search_parse(session->query, &words);
+	if (!nwords) {
+		fprintf(stderr, "nothing to search for\n");
+		retval = -EINVAL;
+		goto exit;
+	}
+	for (i = 0; i < nwords; i++)
+		if (words[i].phrase > phrases)
+			phrases = words[i].phrase;
+
+	file = alloca(strlen(session->homedir) + strlen(search_file) + 2);
+	sprintf(file, "%s/%s", session->homedir, search_file);
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		retval = -errno;
+		goto exit;
+	}
+	if (!st.st_size)
+		goto exit;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		retval = -errno;
+		goto exit;
+	}
+
+	for (i = 0; i < nwords; i++) {
+		if (!i) {
+			noffsets = search_postings(map, st.st_size, &words[i],
+						   &offsets);
+		} else {
+			nother = search_postings(map, st.st_size, &words[i],
+						 &other);
+			noffsets = search_intersect(offsets, noffsets, other,
+						    nother);
+			free(other);
+		}
+		if (!noffsets)
+			goto exit;
+	}
+
+	log_size = session->store->index->log_size;
+	log = mmap(NULL, log_size, PROT_READ, MAP_SHARED,
+		   session->store->log_fd, 0);
+	if (log == MAP_FAILED) {
+		log = NULL;
+		retval = -errno;
+		goto exit;
+	}
+	match = malloc(noffsets * sizeof(*match));
+	if (!match) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+	for (i = 0; i < noffsets; i++) {
+		rec = status_record_at(log, log_size, offsets[i]);
+		if (!rec || rec->host != host)
+			continue;
+		for (phrase = 1; phrase <= phrases; phrase++)
+			if (!search_phrase(status_record_text(rec), words,
+					   nwords, phrase) &&
+			    !search_phrase(status_record_user(rec), words,
+					   nwords, phrase))
+				break;
+		if (phrase <= phrases)
+			continue;
+		match[count++] = rec;
+	}
+	print_records(session, match, count);
+
+exit:
+	free(match);
+	free(offsets);
+	free(words);
+	if (log)
+		munmap(log, log_size);
+	if (map)
+		munmap(map, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	return retval;
+}
+
+/*
+ * A target of a fanned out update.  Every target has its own handle so
+ * that all of them can be in flight at the same time, and keeps it for
+ * the next update.
+ */
+struct target_send {
+	struct multi_job job;
+	struct session *session;
+	struct request req;
+	struct bti_curl_buffer *curl_buf;
+	struct target *target;
+	int quiet;
+	int failed;
+};
+
+static void target_complete(struct multi_job *job)
+{
+	struct target_send *send = container_of(job, struct target_send, job);
+	double total = 0;
+	long code = 0;
+
+	curl_easy_getinfo(job->curl, CURLINFO_RESPONSE_CODE, &code);
+	curl_easy_getinfo(job->curl, CURLINFO_TOTAL_TIME, &total);
+	send->failed = job->result || code < 200 || code >= 300;
+
+	stats_transfer(send->session, job->curl);
+	if (job->result == CURLE_COULDNT_CONNECT)
+		dns_cache_forget(send->session, job->curl);
+	else if (!job->result)
+		dns_cache_learn(send->session, job->curl);
+	bti_curl_buffer_stats(send->curl_buf, job->curl);
+	request_cleanup(&send->req);
+
+	if (send->quiet)
+		return;
+	if (job->result)
+		printf("%s: failed, error(%d) after %.0f ms\n",
+		       send->target->hosturl, job->result, total * 1000);
+	else
+		printf("%s: %s, http %ld in %.0f ms\n", send->target->hosturl,
+		       send->failed ? "failed" : "ok", code, total * 1000);
+	fflush(stdout);
+}
+
+/* Post the update to every configured target at once */
+static int send_update_targets(struct session *session)
+{
+	struct target_send *sends;
+	struct multi_job **jobs;
+	struct target_send *send;
+	int retval = 0;
+	int i;
+
+	sends = zalloc(session->ntargets * sizeof(*sends));
+	jobs = zalloc(session->ntargets * sizeof(*jobs));
+	if (!sends || !jobs) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+
+	for (i = 0; i < session->ntargets; i++) {
+		send = &sends[i];
+		send->session = session;
+		send->target = &session->targets[i];
+		send->quiet = session->bash;
+		send->curl_buf = bti_curl_buffer_alloc(session->max_body);
+		send->job.curl = curl_reuse(session,
+					    &send->target->curl);
+		if (!send->curl_buf || !send->job.curl) {
+			retval = -ENOMEM;
+			goto exit;
+		}
+		bti_curl_buffer_reset(send->curl_buf, session->action);
+
+		request_setup(session, send->target, NULL, send->job.curl,
+			      &send->req, 0);
+		curl_easy_setopt(send->job.curl, CURLOPT_WRITEFUNCTION,
+				 curl_callback);
+		curl_easy_setopt(send->job.curl, CURLOPT_WRITEDATA,
+				 send->curl_buf);
+		send->job.complete = target_complete;
+		jobs[i] = &send->job;
+	}
+
+	if (session->dry_run)
+		goto exit;
+
+	/* there is no point in making the fast hosts wait */
+	retval = multi_perform(jobs, session->ntargets, session->ntargets,
+			       NULL, NULL);
+	for (i = 0; i < session->ntargets; i++)
+		if (sends[i].failed)
+			retval = -EINVAL;
+
+exit:
+	for (i = 0; sends && i < session->ntargets; i++) {
+		send = &sends[i];
+		request_cleanup(&send->req);
+		bti_curl_buffer_free(send->curl_buf);
+	}
+	free(sends);
+	free(jobs);
+	return retval;
+}
+
+/*
+ * Send the update of the session, to every target if there are any and
+ * no host was asked for on the command line.
+ */
+static int send_update(struct session *session)
+{
+	if (session->ntargets && !session->host_override)
+		return send_update_targets(session);
+	return send_request(session);
+}
+
+/*
+ * Parse a byte count with an optional k, M or G suffix.  Anything else,
+ * a negative count included, is -EINVAL rather than 0, which turns off
+ * the limits given this way.
+ */
+static int parse_size(const char *str, size_t *size)
+{
+	unsigned long long value;
+	unsigned long long unit = 1;
+	char *end;
+
+	if (!isdigit(*str))
+		return -EINVAL;
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if (errno)
+		return -EINVAL;
+	switch (*end) {
+	case 'g':
+	case 'G':
+		unit *= 1024;
+		/* fall through */
+	case 'm':
+	case 'M':
+		unit *= 1024;
+		/* fall through */
+	case 'k':
+	case 'K':
+		unit *= 1024;
+		end++;
+		break;
+	default:
+		break;
+	}
+	if (*end || value > SSIZE_MAX / unit)
+		return -EINVAL;
+	*size = value * unit;
+	return 0;
+}
+
+/*
+ * Add a target from a "target=HOST [ACCOUNT [PASSWORD]]" config line.
+ * A missing account or password is taken from the session.
+ */
+static int session_add_target(struct session *session, char *spec)
+{
+	struct target *targets;
+	struct target target = { };
+	char *save = NULL;
+	char *word;
+
+	word = strtok_r(spec, " \t", &save);
+	if (!word)
+		return -EINVAL;
+
+	target.hosturl = parse_host(word, &target.host);
+	if (!target.hosturl)
+		goto error;
+	word = strtok_r(NULL, " \t", &save);
+	if (word) {
+		target.account = strdup(word);
+		if (!target.account)
+			goto error;
+	}
+	word = strtok_r(NULL, " \t", &save);
+	if (word) {
+		target.password = strdup(word);
+		if (!target.password)
+			goto error;
+	}
+
+	targets = realloc(session->targets,
+			  (session->ntargets + 1) * sizeof(*targets));
+	if (!targets)
+		goto error;
+	session->targets = targets;
+	targets[session->ntargets++] = target;
+	return 0;
+
+error:
+	free(target.hosturl);
+	free(target.account);
+	free(target.password);
+	return -ENOMEM;
+}
+
+static int parse_format(const char *name, enum output_format *format)
+{
+	if (strcasecmp(name, "human") == 0)
+		*format = OUTPUT_HUMAN;
+	else if (strcasecmp(name, "json") == 0)
+		*format = OUTPUT_JSON;
+	else if (strcasecmp(name, "tsv") == 0)
+		*format = OUTPUT_TSV;
+	else if (strcasecmp(name, "nul") == 0)
+		*format = OUTPUT_NUL;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+/* Polling interval bounds for --follow, in seconds: MIN or MIN-MAX */
+static void parse_interval(struct session *session, const char *str)
+{
+	double min;
+	double max;
+
+	switch (sscanf(str, "%lf-%lf", &min, &max)) {
+	case 1:
+		max = min > session->follow_max ? min : session->follow_max;
+		break;
+	case 2:
+		break;
+	default:
+		return;
+	}
+	if (min <= 0 || max < min)
+		return;
+	session->follow_min = min;
+	session->follow_max = max;
+	dbg("follow interval = %g-%g\n", min, max);
+}
+
+/*
+ * A point in time for --since and --until: seconds since the epoch, a
+ * UTC "YYYY-MM-DD[ HH:MM[:SS]]", or an age like "90m", "6h" or "2d".
+ * Returns -1 if it is none of those.
+ */
+static time_t parse_when(const char *str)
+{
+	int year, month, day;
+	int hour = 0;
+	int minute = 0;
+	int second = 0;
+	char unit;
+	char *end;
+	long long value;
+	int len;
+
+	if (sscanf(str, "%d-%d-%d%n", &year, &month, &day, &len) == 3) {
+		str += len;
+		if (*str == ' ' || *str == 'T') {
+			if (sscanf(str + 1, "%d:%d%n", &hour, &minute,
+				   &len) < 2)
+				return -1;
+			str += len + 1;
+			if (*str == ':' &&
+			    sscanf(str + 1, "%d%n", &second, &len) == 1)
+				str += len + 1;
+		}
+		if (*str || month < 1 || month > 12 || day < 1 || day > 31)
+			return -1;
+		return days_from_civil(year, month, day) * 86400 +
+		       hour * 3600 + minute * 60 + second;
+	}
+
+	value = strtoll(str, &end, 10);
+	if (end == str || value < 0)
+		return -1;
+	unit = *end;
+	if (unit && end[1])
+		return -1;
+	switch (unit) {
+	case '\0':
+		return value;
+	case 'd':
+		value *= 24;
+		/* fall through */
+	case 'h':
+		value *= 60;
+		/* fall through */
+	case 'm':
+		value *= 60;
+		/* fall through */
+	case 's':
+		return time(NULL) - value;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Map an action name to its value.  The "local-" variants of the
+ * timelines are answered from the status store instead of the server.
+ */
+static enum action parse_action(const char *name, int *local)
+{
+	*local = !strncasecmp(name, "local-", 6);
+	if (*local)
+		name += 6;
+
+	if (strcasecmp(name, "update") == 0 && !*local)
+		return ACTION_UPDATE;
+	else if (strcasecmp(name, "friends") == 0)
+		return ACTION_FRIENDS;
+	else if (strcasecmp(name, "user") == 0)
+		return ACTION_USER;
+	else if (strcasecmp(name, "replies") == 0)
+		return ACTION_REPLIES;
+	else if (strcasecmp(name, "public") == 0)
+		return ACTION_PUBLIC;
+	else if (strcasecmp(name, "search") == 0 && !*local)
+		return ACTION_SEARCH;
+	return ACTION_UNKNOWN;
+}
+
+/*
+ * Take an action, or a comma separated list of timelines to merge.  The
+ * list is kept in session->actions, with its first entry as the action,
+ * which is ACTION_UNKNOWN if the list holds anything that can not be
+ * merged.
+ */
+static void parse_actions(struct session *session, const char *list)
+{
+	enum action action;
+	char *names;
+	char *name;
+	char *save;
+	int local;
+	int first = 1;
+
+	free(session->actions);
+	session->actions = NULL;
+	if (!strchr(list, ',')) {
+		session->action = parse_action(list, &session->local);
+		return;
+	}
+
+	session->local = 0;
+	session->action = ACTION_UNKNOWN;
+	names = strdupa(list);
+	for (name = strtok_r(names, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		action = parse_action(name, &local);
+		if (local || action == ACTION_UPDATE ||
+		    action == ACTION_SEARCH || action == ACTION_UNKNOWN) {
+			session->action = ACTION_UNKNOWN;
+			return;
+		}
+		if (first)
+			session->action = action;
+		first = 0;
+	}
+	if (!first)
+		session->actions = strdup(list);
+}
+
+static void parse_configfile(struct session *session)
+{
+	FILE *config_file;
+	char *line = NULL;
+	size_t len = 0;
+	char *account = NULL;
+	char *password = NULL;
+	char *host = NULL;
+	char *proxy = NULL;
+	char *logfile = NULL;
+	char *action = NULL;
+	char *user = NULL;
+	char *file;
+	char *end;
+	size_t size;
+	long days;
+	int shrink_urls = 0;
+
+	/* config file is ~/.bti  */
+	file = alloca(strlen(session->homedir) + 7);
+
+	sprintf(file, "%s/.bti", session->homedir);
+
+	config_file = fopen(file, "r");
+
+	/* No error if file does not exist or is unreadable.  */
+	if (config_file == NULL)
+		return;
+
+	do {
+		ssize_t n = getline(&line, &len, config_file);
+		if (n < 0)
+			break;
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		/* Parse file.  Format is the usual value pairs:
+		   account=name
+		   passwort=value
+		   # is a comment character
+		*/
+		*strchrnul(line, '#') = '\0';
+		char *c = line;
+		while (isspace(*c))
+			c++;
+		/* Ignore blank lines.  */
+		if (c[0] == '\0')
+			continue;
+
+		if (!strncasecmp(c, "account", 7) && (c[7] == '=')) {
+			c += 8;
+			if (c[0] != '\0')
+				account = strdup(c);
+		} else if (!strncasecmp(c, "password", 8) &&
+			   (c[8] == '=')) {
+			c += 9;
+			if (c[0] != '\0')
+				password = strdup(c);
+		} else if (!strncasecmp(c, "host", 4) &&
+			   (c[4] == '=')) {
+			c += 5;
+			if (c[0] != '\0')
+				host = strdup(c);
+		} else if (!strncasecmp(c, "proxy", 5) &&
+			   (c[5] == '=')) {
+			c += 6;
+			if (c[0] != '\0')
+				proxy = strdup(c);
+		} else if (!strncasecmp(c, "logfile", 7) &&
+			   (c[7] == '=')) {
+			c += 8;
+			if (c[0] != '\0')
+				logfile = strdup(c);
+		} else if (!strncasecmp(c, "action", 6) &&
+			   (c[6] == '=')) {
+			c += 7;
+			if (c[0] != '\0')
+				action = strdup(c);
+		} else if (!strncasecmp(c, "user", 4) &&
+				(c[4] == '=')) {
+			c += 5;
+			if (c[0] != '\0')
+				user = strdup(c);
+		} else if (!strncasecmp(c, "shrink-urls", 11) &&
+				(c[11] == '=')) {
+			c += 12;
+			if (!strncasecmp(c, "true", 4) ||
+					!strncasecmp(c, "yes", 3))
+				shrink_urls = 1;
+		}
+		else if (!strncasecmp(c, "verbose", 7) &&
+				(c[7] == '=')) {
+			c += 8;
+			if (!strncasecmp(c, "true", 4) ||
+					!strncasecmp(c, "yes", 3))
+				verbose = 1;
+		} else if (!strncasecmp(c, "target", 6) &&
+				(c[6] == '=')) {
+			c += 7;
+			if (c[0] != '\0' && session_add_target(session, c))
+				fprintf(stderr, "cannot add target %s\n", c);
+		} else if (!strncasecmp(c, "shrinker", 8) &&
+				(c[8] == '=')) {
+			c += 9;
+			if (c[0] != '\0') {
+				free(session->shrinker);
+				session->shrinker = strdup(c);
+			}
+		} else if (!strncasecmp(c, "shrink-timeout", 14) &&
+				(c[14] == '=')) {
+			c += 15;
+			if (c[0] != '\0')
+				session->shrink_timeout = atof(c);
+		} else if (!strncasecmp(c, "url-scanner", 11) &&
+				(c[11] == '=')) {
+			c += 12;
+			if (!strcasecmp(c, "builtin"))
+				url_scanner = URL_SCANNER_BUILTIN;
+			else
+				url_scanner = URL_SCANNER_PCRE;
+		} else if (!strncasecmp(c, "url-cache", 9) &&
+				(c[9] == '=')) {
+			c += 10;
+			session->url_cache_enabled =
+				!strncasecmp(c, "true", 4) ||
+				!strncasecmp(c, "yes", 3);
+		} else if (!strncasecmp(c, "url-cache-ttl", 13) &&
+				(c[13] == '=')) {
+			c += 14;
+			errno = 0;
+			days = strtol(c, &end, 10);
+			if (!isdigit(c[0]) || *end || errno ||
+			    days > LONG_MAX / (24 * 60 * 60))
+				fprintf(stderr, "invalid url-cache-ttl %s\n", c);
+			else
+				session->url_cache_ttl =
+					(time_t)days * 24 * 60 * 60;
+		} else if (!strncasecmp(c, "rate", 4) &&
+				(c[4] == '=')) {
+			c += 5;
+			if (c[0] != '\0')
+				session->rate = atof(c);
+		} else if (!strncasecmp(c, "jobs", 4) &&
+				(c[4] == '=')) {
+			c += 5;
+			if (c[0] != '\0')
+				session->jobs = atoi(c);
+		} else if (!strncasecmp(c, "format", 6) &&
+				(c[6] == '=')) {
+			c += 7;
+			parse_format(c, &session->format);
+		} else if (!strncasecmp(c, "follow-interval", 15) &&
+				(c[15] == '=')) {
+			c += 16;
+			if (c[0] != '\0')
+				parse_interval(session, c);
+		} else if (!strncasecmp(c, "store", 5) &&
+				(c[5] == '=')) {
+			c += 6;
+			session->store_enabled =
+				!strncasecmp(c, "true", 4) ||
+				!strncasecmp(c, "yes", 3);
+		} else if (!strncasecmp(c, "incremental", 11) &&
+				(c[11] == '=')) {
+			c += 12;
+			session->incremental =
+				!strncasecmp(c, "true", 4) ||
+				!strncasecmp(c, "yes", 3);
+		} else if (!strncasecmp(c, "stats", 5) &&
+				(c[5] == '=')) {
+			c += 6;
+			session->stats =
+				!strncasecmp(c, "true", 4) ||
+				!strncasecmp(c, "yes", 3);
+		} else if (!strncasecmp(c, "net-cache-ttl", 13) &&
+				(c[13] == '=')) {
+			c += 14;
+			if (c[0] != '\0')
+				session->net_cache_ttl = atoi(c);
+		} else if (!strncasecmp(c, "net-cache", 9) &&
+				(c[9] == '=')) {
+			c += 10;
+			session->net_cache_enabled =
+				!strncasecmp(c, "true", 4) ||
+				!strncasecmp(c, "yes", 3);
+		} else if (!strncasecmp(c, "log-max-size", 12) &&
+				(c[12] == '=')) {
+			c += 13;
+			if (parse_size(c, &size))
+				fprintf(stderr, "invalid log-max-size %s\n",
+					c);
+			else
+				session->log_max_size = size;
+		} else if (!strncasecmp(c, "max-body", 8) &&
+				(c[8] == '=')) {
+			c += 9;
+			if (parse_size(c, &size))
+				fprintf(stderr, "invalid max-body %s\n", c);
+			else
+				session->max_body = size;
+		}
+	} while (!feof(config_file));
+
+	if (password)
+		session->password = password;
+	if (account)
+		session->account = account;
+	if (host) {
+		session->hosturl = parse_host(host, &session->host);
+		free(host);
+	}
+	if (proxy) {
+		if (session->proxy)
+			free(session->proxy);
+		session->proxy = proxy;
+	}
+	if (logfile)
+		session->logfile = logfile;
+	if (action) {
+		parse_actions(session, action);
+		free(action);
+	}
+	if (user)
+		session->user = user;
+	session->shrink_urls = shrink_urls;
+
+	/* Free buffer and close file.  */
+	free(line);
+	fclose(config_file);
+}
+
+static const char *action_name(enum action action)
+{
+	switch (action) {
+	case ACTION_UPDATE:
+		return "update";
+	case ACTION_FRIENDS:
+		return "friends";
+	case ACTION_USER:
+		return "user";
+	case ACTION_REPLIES:
+		return "replies";
+	case ACTION_PUBLIC:
+		return "public";
+	case ACTION_SEARCH:
+		return "search";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * One timeline of a merge.  Its statuses are parsed as they arrive and
+ * queued until it is their turn, and the transfer is paused while the
+ * queue is full, so a merge never holds more than about
+ * MERGE_QUEUE_MAX statuses per timeline however long they are.
+ */
+struct merge_source {
+	struct multi_job job;
+	struct session *session;
+	struct timeline_source source;
+	struct request req;
+	struct bti_curl_buffer *curl_buf;
+	struct status_queue queue;
+};
+
+struct timeline_merge {
+	struct session *session;
+	struct merge_source *sources;
+	int count;
+	struct name_table *names;	/* shared by all the timelines */
+	struct merge_source **heap;	/* by the head of their queue */
+	int heap_size;
+	unsigned long long last_id;
+};
+
+/* Whether the head of @a goes out before the head of @b */
+static int merge_newer(const struct merge_source *a,
+		       const struct merge_source *b)
+{
+	const struct queued_status *x = a->queue.head;
+	const struct queued_status *y = b->queue.head;
+
+	if (x->created_time != y->created_time)
+		return x->created_time > y->created_time;
+	return x->id > y->id;
+}
+
+static void merge_sift_up(struct timeline_merge *merge, int i)
+{
+	struct merge_source *source = merge->heap[i];
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!merge_newer(source, merge->heap[parent]))
+			break;
+		merge->heap[i] = merge->heap[parent];
+		i = parent;
+	}
+	merge->heap[i] = source;
+}
+
+static void merge_sift_down(struct timeline_merge *merge, int i)
+{
+	struct merge_source *source = merge->heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < merge->heap_size) {
+		if (child + 1 < merge->heap_size &&
+		    merge_newer(merge->heap[child + 1], merge->heap[child]))
+			child++;
+		if (!merge_newer(merge->heap[child], source))
+			break;
+		merge->heap[i] = merge->heap[child];
+		i = child;
+	}
+	merge->heap[i] = source;
+}
+
+static void merge_complete(struct multi_job *job)
+{
+	struct merge_source *source = container_of(job, struct merge_source,
+						   job);
+	struct bti_curl_buffer *curl_buf = source->curl_buf;
+
+	stats_transfer(source->session, job->curl);
+	if (job->result) {
+		fprintf(stderr, "error(%d) trying to fetch %s\n",
+			job->result, source->req.endpoint);
+		if (job->result == CURLE_COULDNT_CONNECT)
+			dns_cache_forget(source->session, job->curl);
+	} else {
+		dns_cache_learn(source->session, job->curl);
+		timeline_finish(source->session, &source->req, job->curl,
+				curl_buf);
+	}
+
+	bti_curl_buffer_stats(curl_buf, job->curl);
+	timeline_parser_free(curl_buf->parser);
+	curl_buf->parser = NULL;
+	request_cleanup(&source->req);
+	source->queue.done = 1;
+}
+
+/*
+ * Print every status that is known to be the newest one left.  That is
+ * only the case while each timeline still being fetched has at least
+ * one status queued, anything it has not sent yet could be newer.
+ */
+static void merge_flush(void *data)
+{
+	struct timeline_merge *merge = data;
+	struct session *session = merge->session;
+	struct merge_source *source;
+	struct queued_status *status;
+	int starved = 0;
+	int i;
+
+	for (i = 0; i < merge->count; i++) {
+		source = &merge->sources[i];
+		if (source->queue.head && !source->queue.in_heap) {
+			source->queue.in_heap = 1;
+			merge->heap[merge->heap_size++] = source;
+			merge_sift_up(merge, merge->heap_size - 1);
+		} else if (!source->queue.head && !source->queue.done) {
+			starved++;
+		}
+	}
+
+	while (!starved && merge->heap_size) {
+		source = merge->heap[0];
+		status = status_queue_pop(&source->queue);
+		/* the same status on several timelines is printed once */
+		if (!status->id || status->id != merge->last_id) {
+			output_status(session->output, status->id,
+				      status->created, status->user,
+				      status->text);
+			session->statuses++;
+			merge->last_id = status->id;
+		}
+		status_queue_release(&source->queue, status);
+
+		if (source->queue.head) {
+			merge_sift_down(merge, 0);
+			continue;
+		}
+		source->queue.in_heap = 0;
+		merge->heap[0] = merge->heap[--merge->heap_size];
+		if (merge->heap_size)
+			merge_sift_down(merge, 0);
+		if (!source->queue.done)
+			starved++;
+	}
+
+	for (i = 0; i < merge->count; i++) {
+		source = &merge->sources[i];
+		if (source->queue.paused &&
+		    source->queue.count <= MERGE_QUEUE_MAX / 2) {
+			source->queue.paused = 0;
+			curl_easy_pause(source->job.curl, CURLPAUSE_CONT);
+		}
+	}
+	output_flush(session->output);
+}
+
+/*
+ * Fill in @sources, if set, with every timeline of the session and
+ * return how many there are.  A list of actions reads all of them, and
+ * the user timeline is read for every user in the list of users.
+ */
+static int timeline_sources(struct session *session,
+			    struct timeline_source *sources)
+{
+	char *actions;
+	char *users;
+	char *name;
+	char *user;
+	char *save;
+	char *save_user;
+	enum action action;
+	int local;
+	int count = 0;
+
+	actions = strdupa(session->actions ? session->actions :
+			  action_name(session->action));
+	for (name = strtok_r(actions, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		action = parse_action(name, &local);
+		if (action != ACTION_USER) {
+			if (sources) {
+				sources[count].action = action;
+				sources[count].user = NULL;
+			}
+			count++;
+			continue;
+		}
+		users = strdupa(session->user);
+		for (user = strtok_r(users, ",", &save_user); user;
+		     user = strtok_r(NULL, ",", &save_user)) {
+			if (sources) {
+				sources[count].action = action;
+				sources[count].user = strdup(user);
+			}
+			count++;
+		}
+	}
+	return count;
+}
+
+/* Whether the session reads more than one timeline */
+static int timeline_merging(struct session *session)
+{
+	return session->actions ||
+	       (session->action == ACTION_USER && session->user &&
+		strchr(session->user, ','));
+}
+
+/*
+ * Fetch every timeline of the session at the same time and print them
+ * as one, newest first, the way the server would if it could.
+ */
+static int fetch_merged(struct session *session)
+{
+	struct timeline_merge merge = { .session = session };
+	struct timeline_source *sources = NULL;
+	struct multi_job **jobs = NULL;
+	struct merge_source *source;
+	struct timeline_parser *parser;
+	int retval = 0;
+	int i;
+
+	merge.count = timeline_sources(session, NULL);
+	merge.sources = zalloc(merge.count * sizeof(*merge.sources));
+	merge.heap = zalloc(merge.count * sizeof(*merge.heap));
+	sources = zalloc(merge.count * sizeof(*sources));
+	jobs = zalloc(merge.count * sizeof(*jobs));
+	merge.names = name_table_alloc();
+	if (!merge.sources || !merge.heap || !sources || !jobs ||
+	    !merge.names) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+	timeline_sources(session, sources);
+
+	for (i = 0; i < merge.count; i++) {
+		source = &merge.sources[i];
+		source->session = session;
+		source->source = sources[i];
+		source->queue.names = merge.names;
+		source->curl_buf = bti_curl_buffer_alloc(session->max_body);
+		source->job.curl = curl_init(session);
+		if (!source->curl_buf || !source->job.curl ||
+		    (source->source.action == ACTION_USER &&
+		     !source->source.user)) {
+			retval = -ENOMEM;
+			goto exit;
+		}
+		bti_curl_buffer_reset(source->curl_buf, source->source.action);
+		parser = timeline_parser_alloc(session, session->output);
+		if (!parser) {
+			retval = -ENOMEM;
+			goto exit;
+		}
+		parser->queue = &source->queue;
+		if (parser->store)
+			parser->timeline = source->source.action;
+		source->curl_buf->parser = parser;
+
+		request_setup(session, NULL, &source->source, source->job.curl,
+			      &source->req, session->page);
+		curl_easy_setopt(source->job.curl, CURLOPT_WRITEFUNCTION,
+				 curl_callback);
+		curl_easy_setopt(source->job.curl, CURLOPT_WRITEDATA,
+				 source->curl_buf);
+		curl_easy_setopt(source->job.curl, CURLOPT_HEADERFUNCTION,
+				 curl_header_callback);
+		curl_easy_setopt(source->job.curl, CURLOPT_HEADERDATA,
+				 source->curl_buf);
+		source->job.complete = merge_complete;
+		jobs[i] = &source->job;
+	}
+
+	/* every timeline has to be in flight, or the merge can not go on */
+	if (!session->dry_run) {
+		retval = multi_perform(jobs, merge.count, merge.count,
+				       merge_flush, &merge);
+		merge_flush(&merge);
+	}
+
+	for (i = 0; i < merge.count; i++)
+		if (merge.sources[i].job.result)
+			retval = -EINVAL;
+
+exit:
+	for (i = 0; merge.sources && i < merge.count; i++) {
+		source = &merge.sources[i];
+		status_queue_clear(&source->queue);
+		if (source->curl_buf)
+			timeline_parser_free(source->curl_buf->parser);
+		bti_curl_buffer_free(source->curl_buf);
+		request_cleanup(&source->req);
+		if (source->job.curl)
+			curl_easy_cleanup(source->job.curl);
+	}
+	for (i = 0; sources && i < merge.count; i++)
+		free((char *)sources[i].user);
+	free(sources);
+	free(merge.sources);
+	name_table_free(merge.names);
+	free(merge.heap);
+	free(jobs);
+	return retval;
+}
+
+static const char since_file[] = ".bti_since";
+
+/*
+ * The checkpoint file holds one "host account action user id" line,
+ * separated by tabs, for every timeline we have fetched incrementally.
+ * Fills in @key with everything up to and including the tab before
+ * the id.
+ */
+static void since_key(struct session *session, char *key, size_t size)
+{
+	snprintf(key, size, "%s\t%s\t%s\t%s\t", session->hosturl,
+		 session->account ? session->account : "",
+		 action_name(session->action),
+		 session->action == ACTION_USER && session->user ?
+			session->user : "");
+}
+
+static void since_load(struct session *session)
+{
+	char key[1024];
+	char *value;
+
+	since_key(session, key, sizeof(key));
+	value = state_load(session, since_file, key);
+	if (value)
+		session->since_id = strtoull(value, NULL, 10);
+	free(value);
+
+	dbg("since_id = %llu\n", session->since_id);
+}
+
+/* A concurrent run may have got further than us */
+static int since_newer(const char *old, const char *value)
+{
+	return strtoull(old, NULL, 10) > strtoull(value, NULL, 10);
+}
+
+/* Record the newest id we saw */
+static int since_save(struct session *session)
+{
+	char key[1024];
+	char value[32];
+	int retval;
+
+	if (session->max_id <= session->since_id)
+		return 0;
+	if (session_filtered(session)) {
+		dbg("since_id not saved, statuses were left out\n");
+		return 0;
+	}
+
+	since_key(session, key, sizeof(key));
+	snprintf(value, sizeof(value), "%llu", session->max_id);
+	retval = state_store(session, since_file, key, value, since_newer);
+	dbg("since_id %s saved, retval = %d\n", value, retval);
+	return retval;
+}
+
+/*
+ * Log one thing bti did, that started at @begin on the monotonic clock.
+ * The bytes and statuses are what came in since the last record.
+ */
+static void log_session(struct session *session, int retval, double begin)
+{
+	struct log_writer *log = session->log;
+	struct output *out;
+	struct timespec ts;
+	char number[64];
+	char *filename;
+	const char *host;
+	double now;
+
+	/* Only log something if we have a log file set */
+	if (!session->logfile)
+		return;
+
+	if (!log) {
+		filename = alloca(strlen(session->homedir) +
+				  strlen(session->logfile) + 3);
+		sprintf(filename, "%s/%s", session->homedir,
+			session->logfile);
+		log = log_open(filename, session->log_max_size);
+		if (!log) {
+			dbg("cannot open %s\n", filename);
+			return;
+		}
+		session->log = log;
+	}
+
+	switch (session->host) {
+	case HOST_TWITTER:
+		host = "twitter";
+		break;
+	case HOST_IDENTICA:
+		host = "identi.ca";
+		break;
+	default:
+		host = session->hosturl ? session->hosturl : "";
+		break;
+	}
+
+	now = monotonic_time();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	out = log->batch;
+	if (!out->length)
+		log->oldest = now;
+
+	snprintf(number, sizeof(number), "{\"time\":%lld.%03ld,\"host\":",
+		 (long long)ts.tv_sec, ts.tv_nsec / 1000000);
+	output_string(out, number);
+	output_json(out, host);
+	output_string(out, ",\"action\":\"");
+	if (session->local)
+		output_string(out, "local-");
+	output_string(out, session->actions ? session->actions :
+		      action_name(session->action));
+	output_char(out, '"');
+	if (session->action == ACTION_USER && session->user) {
+		output_string(out, ",\"user\":");
+		output_json(out, session->user);
+	}
+	snprintf(number, sizeof(number), ",\"result\":%d,\"latency_ms\":%.3f",
+		 retval, (now - begin) * 1000);
+	output_string(out, number);
+	snprintf(number, sizeof(number), ",\"bytes\":%llu,\"statuses\":%lu",
+		 session->times.bytes - log->bytes,
+		 session->statuses - log->statuses);
+	output_string(out, number);
+	if (session->action == ACTION_UPDATE && session->tweet) {
+		output_string(out, ",\"tweet\":");
+		output_json(out, session->tweet);
+	}
+	output_string(out, "}\n");
+	log->bytes = session->times.bytes;
+	log->statuses = session->statuses;
+
+	if (out->length >= LOG_BATCH_SIZE || now - log->oldest >= LOG_BATCH_AGE)
+		log_flush(log);
+}
+
+/*
+ * The --stats report, one JSON object on stderr with the time of every
+ * phase in milliseconds.  "output" is the time spent writing to stdout,
+ * which "parse" does not include.
+ */
+static void print_stats(struct session *session, int retval)
+{
+	struct run_stats *times = &session->times;
+
+	fprintf(stderr, "{\"action\":\"%s%s\",\"result\":%d,"
+		"\"transfers\":%d,\"requests\":%d,\"not_modified\":%d,"
+		"\"statuses\":%lu,\"wire_bytes\":%llu,\"body_bytes\":%llu,"
+		"\"ms\":{\"total\":%.3f,\"config\":%.3f,\"shrink\":%.3f,"
+		"\"dns\":%.3f,\"connect\":%.3f,\"tls\":%.3f,"
+		"\"server\":%.3f,\"transfer\":%.3f,\"parse\":%.3f,"
+		"\"output\":%.3f}}\n",
+		session->local ? "local-" : "",
+		session->actions ? session->actions :
+				   action_name(session->action),
+		retval, times->transfers, session->requests,
+		session->not_modified, session->statuses, session->wire_bytes,
+		session->body_bytes,
+		(monotonic_time() - times->start) * 1000, times->config * 1000,
+		times->shrink * 1000, times->dns * 1000,
+		times->connect * 1000, times->tls * 1000,
+		times->server * 1000, times->transfer * 1000,
+		times->parse * 1000, session->output->write_time * 1000);
+}
+
+/* readline() is only set up when there is something to ask for */
+static char *read_line(const char *prompt)
+{
+	static int initialized;
+
+	if (!initialized) {
+		rl_bind_key('\t', rl_insert);
+		initialized = 1;
+	}
+	return readline(prompt);
+}
+
+/*
+ * Read one item from @file, up to @delim which is dropped.  Returns NULL
+ * at the end of the file.
+ */
+static char *get_string(FILE *file, int delim)
+{
+	char *string = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	len = getdelim(&string, &size, delim, file);
+	if (len < 0) {
+		free(string);
+		return NULL;
+	}
+	if (len && string[len - 1] == delim)
+		string[len - 1] = '\0';
+	return string;
+}
+
+static char *get_string_from_stdin(void)
+{
+	return get_string(stdin, '\n');
+}
+
+/*
+ * magic obtained from
+ * http://www.geekpedia.com/KB65_How-to-validate-an-URL-using-RegEx-in-Csharp.html
+ */
+static const char *re_magic =
+	"(([a-zA-Z][0-9a-zA-Z+\\-\\.]*:)/{1,3}"
+	"[0-9a-zA-Z;/~?:@&=+$\\.\\-_'()%]+)"
+	"(#[0-9a-zA-Z;/?:@&=+$\\.\\-_!~*'()%]+)?";
+
+/*
+ * The url regex, compiled and studied (with the JIT where pcre has one)
+ * the first time it is needed and then kept for the life of the process,
+ * which matters in batch and daemon mode.
+ */
+struct url_matcher {
+	pcre *re;
+	pcre_extra *extra;
+};
+
+static struct url_matcher *url_matcher_get(void)
+{
+	static struct url_matcher matcher;
+	const char *errptr;
+	int erroffset;
+	int options = 0;
+
+	if (matcher.re)
+		return &matcher;
+
+	matcher.re = pcre_compile(re_magic, PCRE_NO_AUTO_CAPTURE,
+				  &errptr, &erroffset, NULL);
+	if (!matcher.re) {
+		fprintf(stderr, "pcre_compile @%u: %s\n", erroffset, errptr);
+		exit(1);
+	}
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+	options |= PCRE_STUDY_JIT_COMPILE;
+#endif
+	/* without a study we are just slower, not wrong */
+	matcher.extra = pcre_study(matcher.re, options, &errptr);
+	if (errptr)
+		dbg("pcre_study: %s\n", errptr);
+	return &matcher;
+}
+
+static int find_urls_pcre(const char *tweet, int len, int **pranges)
+{
+	struct url_matcher *matcher = url_matcher_get();
+	int ovector[3];
+	int startoffset;
+	int rc;
+	int rbound = 8;
+	int rcount = 0;
+	int *ranges = malloc(sizeof(int) * rbound);
+	int *temp;
+
+	for (startoffset = 0; ranges && startoffset < len; ) {
+		rc = pcre_exec(matcher->re, matcher->extra, tweet, len,
+			       startoffset, 0, ovector, 3);
+		if (rc == PCRE_ERROR_NOMATCH)
+			break;
+
+		if (rc < 0) {
+			fprintf(stderr, "pcre_exec @%u: error %d\n",
+				startoffset, rc);
+			exit(1);
+		}
+
+		if (rcount + 2 > rbound) {
+			rbound *= 2;
+			temp = realloc(ranges, sizeof(int) * rbound);
+			if (!temp)
+				break;
+			ranges = temp;
+		}
+
+		ranges[rcount++] = ovector[0];
+		ranges[rcount++] = ovector[1];
+
+		startoffset = ovector[1];
+	}
+
+	*pranges = ranges;
+	return rcount;
+}
+
+/*
+ * Hand written equivalent of re_magic, for when scanning lots of text.
+ * The only way to start a url is a "scheme:/" so the scanner lets
+ * memchr(), which the C library vectorizes, skip ahead to the next ':'
+ * and only then looks around it:
+ *
+ *  - the scheme is the run of [0-9a-zA-Z+-.] right before the ':' and
+ *    the url starts at its first letter
+ *  - after the ':' there must be a run of at least two characters of
+ *    the body class, the first one a '/' (that is "/{1,3}" followed by
+ *    "[...]+", as the slashes are part of the body class too)
+ *  - an optional '#' and a run of the fragment class end it
+ *
+ * Every part is a greedy run of one character class, which is exactly
+ * what the regex matches, so both return the same ranges.
+ */
+#define URL_SCHEME	0x01
+#define URL_BODY	0x02
+#define URL_FRAGMENT	0x04
+#define URL_ALPHA	0x08
+
+static unsigned char url_class[256];
+
+static void url_class_init(void)
+{
+	static const char alpha[] =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	const char *c;
+
+	for (c = alpha; *c; c++)
+		url_class[(unsigned char)*c] =
+			URL_ALPHA | URL_SCHEME | URL_BODY | URL_FRAGMENT;
+	for (c = "0123456789"; *c; c++)
+		url_class[(unsigned char)*c] =
+			URL_SCHEME | URL_BODY | URL_FRAGMENT;
+	for (c = "+-."; *c; c++)
+		url_class[(unsigned char)*c] |= URL_SCHEME;
+	for (c = ";/~?:@&=+$.-_'()%"; *c; c++)
+		url_class[(unsigned char)*c] |= URL_BODY;
+	for (c = ";/?:@&=+$.-_!~*'()%"; *c; c++)
+		url_class[(unsigned char)*c] |= URL_FRAGMENT;
+}
+
+static int find_urls_scan(const char *tweet, int len, int **pranges)
+{
+	const unsigned char *text = (const unsigned char *)tweet;
+	const unsigned char *colon;
+	int rbound = 8;
+	int rcount = 0;
+	int *ranges = malloc(sizeof(int) * rbound);
+	int *temp;
+	int startoffset = 0;
+	int start;
+	int end;
+	int q;
+
+	if (!url_class['a'])
+		url_class_init();
+
+	while (ranges && startoffset < len) {
+		colon = memchr(text + startoffset, ':', len - startoffset);
+		if (!colon)
+			break;
+		q = colon - text;
+
+		/* the body needs a '/' and at least one more character */
+		if (q + 2 >= len || text[q + 1] != '/' ||
+		    !(url_class[text[q + 2]] & URL_BODY)) {
+			startoffset = q + 1;
+			continue;
+		}
+
+		/* walk back over the scheme to where the url starts */
+		start = q;
+		while (start > startoffset &&
+		       (url_class[text[start - 1]] & URL_SCHEME))
+			start--;
+		while (start < q && !(url_class[text[start]] & URL_ALPHA))
+			start++;
+		if (start == q) {
+			startoffset = q + 1;
+			continue;
+		}
+
+		end = q + 1;
+		while (end < len && (url_class[text[end]] & URL_BODY))
+			end++;
+		if (end + 1 < len && text[end] == '#' &&
+		    (url_class[text[end + 1]] & URL_FRAGMENT)) {
+			end++;
+			while (end < len &&
+			       (url_class[text[end]] & URL_FRAGMENT))
+				end++;
+		}
+
+		if (rcount + 2 > rbound) {
+			rbound *= 2;
+			temp = realloc(ranges, sizeof(int) * rbound);
+			if (!temp)
+				break;
+			ranges = temp;
+		}
+		ranges[rcount++] = start;
+		ranges[rcount++] = end;
+		startoffset = end;
+	}
+
+	*pranges = ranges;
+	return rcount;
+}
+
+/*
+ * Find every url in the first @len bytes of @tweet.  *pranges is set to
+ * an array of start and end offsets, and the number of offsets, twice
+ * the number of urls, is returned.
+ */
+static int find_urls(const char *tweet, int len, int **pranges)
+{
+	if (url_scanner == URL_SCANNER_BUILTIN)
+		return find_urls_scan(tweet, len, pranges);
+	return find_urls_pcre(tweet, len, pranges);
+}
+
+/**
+ * bidirectional popen() call
+ *
+ * @param rwepipe - int array of size three
+ * @param exe - program to run
+ * @param argv - argument list
+ * @return pid or -1 on error
+ *
+ * The caller passes in an array of three integers (rwepipe), on successful
+ * execution it can then write to element 0 (stdin of exe), and read from
+ * element 1 (stdout) and 2 (stderr).
+ */
+static int popenRWE(int *rwepipe, const char *exe, const char *const argv[])
+{
+	int in[2];
+	int out[2];
+	int err[2];
+	int pid;
+	int rc;
+
+	rc = pipe(in);
+	if (rc < 0)
+		goto error_in;
+
+	rc = pipe(out);
+	if (rc < 0)
+		goto error_out;
+
+	rc = pipe(err);
+	if (rc < 0)
+		goto error_err;
+
+	pid = fork();
+	if (pid > 0) {
+		/* parent */
+		close(in[0]);
+		close(out[1]);
+		close(err[1]);
+		rwepipe[0] = in[1];
+		rwepipe[1] = out[0];
+		rwepipe[2] = err[0];
+		return pid;
+	} else if (pid == 0) {
+		/* child */
+		close(in[1]);
+		close(out[0]);
+		close(err[0]);
+		close(0);
+		rc = dup(in[0]);
+		close(1);
+		rc = dup(out[1]);
+		close(2);
+		rc = dup(err[1]);
+
+		execvp(exe, (char **)argv);
+		exit(1);
+	} else
+		goto error_fork;
+
+	return pid;
+
+error_fork:
+	close(err[0]);
+	close(err[1]);
+error_err:
+	close(out[0]);
+	close(out[1]);
+error_out:
+	close(in[0]);
+	close(in[1]);
+error_in:
+	return -1;
+}
+
+static int pcloseRWE(int pid, int *rwepipe)
+{
+	int rc, status;
+	close(rwepipe[0]);
+	close(rwepipe[1]);
+	close(rwepipe[2]);
+	rc = waitpid(pid, &status, 0);
+	return status;
+}
+
+static char *shrink_one_url(int *rwepipe, char *big)
+{
+	int biglen = strlen(big);
+	char *small;
+	int smalllen;
+	int rc;
+
+	rc = dprintf(rwepipe[0], "%s\n", big);
+	if (rc < 0)
+		return big;
+
+	smalllen = biglen + 128;
+	small = malloc(smalllen);
+	if (!small)
+		return big;
+
+	rc = read(rwepipe[1], small, smalllen);
+	if (rc < 0 || rc > biglen)
+		goto error_free_small;
+
+	if (strncmp(small, "http://", 7))
+		goto error_free_small;
+
+	smalllen = rc;
+	while (smalllen && isspace(small[smalllen-1]))
+			small[--smalllen] = 0;
+
+	free(big);
+	return small;
+
+error_free_small:
+	free(small);
+	return big;
+}
+
+static const char *shrink_service = "http://2tu.us/?save=y&url=";
+
+/* http://en.wikipedia.org/wiki/Percent-encoding */
+static char *url_escape(const char *url, int len)
+{
+	static const char reserved[] = "%!*'();:@&=+$,/?#[]";
+	static const char hex[] = "0123456789ABCDEF";
+	char *escaped;
+	char *out;
+	int i;
+
+	escaped = malloc(len * 3 + 1);
+	if (!escaped)
+		return NULL;
+
+	for (out = escaped, i = 0; i < len; i++) {
+		unsigned char c = url[i];
+
+		if (c && strchr(reserved, c)) {
+			*out++ = '%';
+			*out++ = hex[c >> 4];
+			*out++ = hex[c & 0xf];
+		} else {
+			*out++ = c;
+		}
+	}
+	*out = '\0';
+	return escaped;
+}
+
+/* One url on its way through the shrinking service */
+struct shrink_job {
+	struct multi_job job;
+	struct bti_curl_buffer *curl_buf;
+	char *request;
+	int long_url_len;
+	char *small;
+};
+
+static void shrink_complete(struct multi_job *job)
+{
+	struct shrink_job *shrink = container_of(job, struct shrink_job, job);
+	static const char marker[] = "Your tight URL is:";
+	char *data = shrink->curl_buf->data;
+	char *start;
+	char *end;
+
+	if (job->result || !data)
+		return;
+
+	/* the url is the first thing quoted after the marker */
+	start = strstr(data, marker);
+	if (!start)
+		return;
+	start = strchr(start + sizeof(marker) - 1, '\'');
+	if (!start)
+		return;
+	end = strchr(++start, '\'');
+	if (!end || strncmp(start, "http", 4) ||
+	    end - start >= shrink->long_url_len)
+		return;
+
+	shrink->small = strndup(start, end - start);
+}
+
+/*
+ * Ask the shrinking service for all of the urls at once.  A url that
+ * comes back missing or not any shorter is left alone.
+ */
+static void shrink_urls_builtin(struct session *session, const char *text,
+				int *ranges, int rcount, char **shorts)
+{
+	struct shrink_job *shrinks;
+	struct multi_job **jobs;
+	struct shrink_job *shrink;
+	int count = rcount / 2;
+	int njobs = 0;
+	char *escaped;
+	int i;
+
+	shrinks = zalloc(count * sizeof(*shrinks));
+	jobs = zalloc(count * sizeof(*jobs));
+	if (!shrinks || !jobs)
+		goto exit;
+
+	for (i = 0; i < count; i++) {
+		/* already known */
+		if (shorts[i])
+			continue;
+
+		shrink = &shrinks[i];
+		shrink->long_url_len = ranges[2 * i + 1] - ranges[2 * i];
+		escaped = url_escape(text + ranges[2 * i],
+				     shrink->long_url_len);
+		if (!escaped)
+			goto exit;
+		if (asprintf(&shrink->request, "%s%s", shrink_service,
+			     escaped) < 0)
+			shrink->request = NULL;
+		free(escaped);
+
+		shrink->curl_buf = bti_curl_buffer_alloc(session->max_body);
+		shrink->job.curl = curl_init(session);
+		if (!shrink->request || !shrink->curl_buf || !shrink->job.curl)
+			goto exit;
+
+		curl_easy_setopt(shrink->job.curl, CURLOPT_URL,
+				 shrink->request);
+		curl_easy_setopt(shrink->job.curl, CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(shrink->job.curl, CURLOPT_TIMEOUT_MS,
+				 (long)(session->shrink_timeout * 1000));
+		curl_easy_setopt(shrink->job.curl, CURLOPT_WRITEFUNCTION,
+				 curl_callback);
+		curl_easy_setopt(shrink->job.curl, CURLOPT_WRITEDATA,
+				 shrink->curl_buf);
+		if (session->proxy)
+			curl_easy_setopt(shrink->job.curl, CURLOPT_PROXY,
+					 session->proxy);
+		shrink->job.complete = shrink_complete;
+		jobs[njobs++] = &shrink->job;
+	}
+
+	multi_perform(jobs, njobs, njobs, NULL, NULL);
+
+	for (i = 0; i < count; i++) {
+		if (!shrinks[i].small)
+			continue;
+		shorts[i] = shrinks[i].small;
+		shrinks[i].small = NULL;
+	}
+
+exit:
+	for (i = 0; shrinks && i < count; i++) {
+		shrink = &shrinks[i];
+		free(shrink->request);
+		free(shrink->small);
+		bti_curl_buffer_free(shrink->curl_buf);
+		if (shrink->job.curl)
+			curl_easy_cleanup(shrink->job.curl);
+	}
+	free(shrinks);
+	free(jobs);
+}
+
+/* Feed the urls one at a time through an external shrinking command */
+static void shrink_urls_command(const char *command, const char *text,
+				int *ranges, int rcount, char **shorts)
+{
+	const char *const shrink_args[] = {
+		command,
+		NULL
+	};
+	int shrink_pid;
+	int shrink_pipe[3];
+	char *url;
+	char *small;
+	int i;
+
+	shrink_pid = popenRWE(shrink_pipe, shrink_args[0], shrink_args);
+	if (shrink_pid < 0)
+		return;
+
+	for (i = 0; i < rcount; i += 2) {
+		if (shorts[i / 2])
+			continue;
+		url = strndup(text + ranges[i], ranges[i+1] - ranges[i]);
+		if (!url)
+			break;
+		small = shrink_one_url(shrink_pipe, url);
+		if (small == url) {
+			free(url);
+			continue;
+		}
+		if (strlen(small) >= (size_t)(ranges[i+1] - ranges[i])) {
+			/* The short url ended up being too long */
+			free(small);
+			continue;
+		}
+		shorts[i / 2] = small;
+	}
+
+	(void)pcloseRWE(shrink_pid, shrink_pipe);
+}
+
+static char *shrink_urls(struct session *session, char *text)
+{
+	int *ranges;
+	int rcount;
+	char **shorts;
+	char *cached;
+	char *result;
+	int inofs = 0;
+	int outofs = 0;
+	int inlen = strlen(text);
+	double start = monotonic_time();
+	int len;
+	int i;
+
+	dbg("before len=%u\n", inlen);
+
+	rcount = find_urls(text, inlen, &ranges);
+	if (!rcount) {
+		free(ranges);
+		session->times.shrink += monotonic_time() - start;
+		return text;
+	}
+
+	shorts = zalloc((rcount / 2) * sizeof(*shorts));
+	cached = zalloc(rcount / 2);
+	result = malloc(inlen + 1);
+	if (!shorts || !cached || !result) {
+		free(shorts);
+		free(cached);
+		free(result);
+		free(ranges);
+		session->times.shrink += monotonic_time() - start;
+		return text;
+	}
+
+	/* anything we have shrunk before does not need the network */
+	if (session->url_cache_enabled && !session->url_cache)
+		session->url_cache = url_cache_open(session->homedir,
+						    session->url_cache_ttl);
+	for (i = 0; session->url_cache && i < rcount; i += 2) {
+		shorts[i / 2] = url_cache_lookup(session->url_cache,
+						 text + ranges[i],
+						 ranges[i+1] - ranges[i]);
+		cached[i / 2] = shorts[i / 2] != NULL;
+	}
+
+	if (!session->shrinker || !strcmp(session->shrinker, "builtin"))
+		shrink_urls_builtin(session, text, ranges, rcount, shorts);
+	else
+		shrink_urls_command(session->shrinker, text, ranges, rcount,
+				    shorts);
+
+	/* splice the short urls in, every short url is shorter than before */
+	for (i = 0; i < rcount; i += 2) {
+		int url_start = ranges[i];
+		int url_end = ranges[i+1];
+		char *url = shorts[i / 2];
+
+		dbg("long  url[%u]: %.*s\n", url_end - url_start,
+		    url_end - url_start, text + url_start);
+		dbg("short url: %s\n", url);
+
+		memcpy(result + outofs, text + inofs, url_start - inofs);
+		outofs += url_start - inofs;
+		if (url) {
+			len = strlen(url);
+			memcpy(result + outofs, url, len);
+			if (session->url_cache && !cached[i / 2])
+				url_cache_store(session->url_cache,
+						text + url_start,
+						url_end - url_start, url);
+		} else {
+			len = url_end - url_start;
+			memcpy(result + outofs, text + url_start, len);
+		}
+		outofs += len;
+		inofs = url_end;
+		free(url);
+	}
+
+	/* copy the last block after the last match */
+	memcpy(result + outofs, text + inofs, inlen - inofs);
+	outofs += inlen - inofs;
+	result[outofs] = 0;
+
+	free(shorts);
+	free(cached);
+	free(ranges);
+	free(text);
+
+	dbg("after len=%u\n", outofs);
+	session->times.shrink += monotonic_time() - start;
+	return result;
+}
+
+/* name of the daemon's socket, relative to the user's home directory */
+static const char *daemon_socket = ".bti.sock";
+
+/* longest update the daemon accepts from a single client line */
+#define DAEMON_MAX_LINE		4096
+#define DAEMON_MAX_CLIENTS	64
+
+struct daemon_client {
+	int fd;
+	size_t length;
+	char data[DAEMON_MAX_LINE];
+};
+
+struct daemon_queue {
+	char **items;
+	int count;
+	int size;
+};
+
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig)
+{
+	daemon_stop = 1;
+}
+
+static int daemon_socket_addr(struct session *session,
+			      struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s",
+		     session->homedir, daemon_socket) >=
+	    (int)sizeof(addr->sun_path))
+		return -ENAMETOOLONG;
+	return 0;
 }
 
-/**
- * bidirectional popen() call
- *
- * @param rwepipe - int array of size three
- * @param exe - program to run
- * @param argv - argument list
- * @return pid or -1 on error
- *
- * The caller passes in an array of three integers (rwepipe), on successful
- * execution it can then write to element 0 (stdin of exe), and read from
- * element 1 (stdout) and 2 (stderr).
+/*
+ * Hand an update over to a running btid.  Returns 0 if the daemon took
+ * it, in which case there is nothing left for us to do.
  */
-static int popenRWE(int *rwepipe, const char *exe, const char *const argv[])
+static int daemon_submit(struct session *session)
 {
-	int in[2];
-	int out[2];
-	int err[2];
-	int pid;
-	int rc;
+	struct sockaddr_un addr;
+	size_t len = strlen(session->tweet);
+	size_t done = 0;
+	ssize_t rc;
+	int fd;
+
+	if (daemon_socket_addr(session, &addr))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -ENOTCONN;
+	}
 
-	rc = pipe(in);
-	if (rc < 0)
-		goto error_in;
+	session->tweet[len] = '\n';
+	while (done < len + 1) {
+		rc = write(fd, session->tweet + done, len + 1 - done);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		done += rc;
+	}
+	session->tweet[len] = '\0';
+	close(fd);
 
-	rc = pipe(out);
-	if (rc < 0)
-		goto error_out;
+	dbg("handed update to btid\n");
+	return done == len + 1 ? 0 : -EIO;
+}
 
-	rc = pipe(err);
-	if (rc < 0)
-		goto error_err;
+static int daemon_listen(struct session *session)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd;
 
-	pid = fork();
-	if (pid > 0) {
-		/* parent */
-		close(in[0]);
-		close(out[1]);
-		close(err[1]);
-		rwepipe[0] = in[1];
-		rwepipe[1] = out[0];
-		rwepipe[2] = err[0];
-		return pid;
-	} else if (pid == 0) {
-		/* child */
-		close(in[1]);
-		close(out[0]);
-		close(err[0]);
-		close(0);
-		rc = dup(in[0]);
-		close(1);
-		rc = dup(out[1]);
-		close(2);
-		rc = dup(err[1]);
+	if (daemon_socket_addr(session, &addr)) {
+		fprintf(stderr, "socket path too long\n");
+		return -1;
+	}
 
-		execvp(exe, (char **)argv);
-		exit(1);
-	} else
-		goto error_fork;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
 
-	return pid;
+	/* a socket nobody answers on is left over from an earlier run */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "btid is already running on %s\n",
+			addr.sun_path);
+		close(fd);
+		return -1;
+	}
+	unlink(addr.sun_path);
+
+	/* only the owner may post through us */
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 16) < 0) {
+		umask(mask);
+		fprintf(stderr, "can not listen on %s: %s\n", addr.sun_path,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+	umask(mask);
 
-error_fork:
-	close(err[0]);
-	close(err[1]);
-error_err:
-	close(out[0]);
-	close(out[1]);
-error_out:
-	close(in[0]);
-	close(in[1]);
-error_in:
-	return -1;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
 }
 
-static int pcloseRWE(int pid, int *rwepipe)
+static int daemon_enqueue(struct daemon_queue *queue, const char *line,
+			  size_t len)
 {
-	int rc, status;
-	close(rwepipe[0]);
-	close(rwepipe[1]);
-	close(rwepipe[2]);
-	rc = waitpid(pid, &status, 0);
-	return status;
+	char **items;
+
+	if (!len)
+		return 0;
+
+	if (queue->count == queue->size) {
+		queue->size = queue->size ? queue->size * 2 : 16;
+		items = realloc(queue->items,
+				queue->size * sizeof(*queue->items));
+		if (!items)
+			return -ENOMEM;
+		queue->items = items;
+	}
+	queue->items[queue->count] = strndup(line, len);
+	if (!queue->items[queue->count])
+		return -ENOMEM;
+	queue->count++;
+	return 0;
 }
 
-static char *shrink_one_url(int *rwepipe, char *big)
+/*
+ * Pull whatever the client has sent us and queue every complete line.
+ * Returns non-zero once the client is done and can be closed.
+ */
+static int daemon_read_client(struct daemon_client *client,
+			      struct daemon_queue *queue)
 {
-	int biglen = strlen(big);
-	char *small;
-	int smalllen;
-	int rc;
+	char *start;
+	char *end;
+	ssize_t rc;
 
-	rc = dprintf(rwepipe[0], "%s\n", big);
+	rc = read(client->fd, client->data + client->length,
+		  sizeof(client->data) - client->length);
 	if (rc < 0)
-		return big;
+		return errno == EINTR || errno == EAGAIN ? 0 : -errno;
+	if (rc == 0) {
+		/* the last update does not need a newline */
+		daemon_enqueue(queue, client->data, client->length);
+		return 1;
+	}
+	client->length += rc;
 
-	smalllen = biglen + 128;
-	small = malloc(smalllen);
-	if (!small)
-		return big;
+	start = client->data;
+	while ((end = memchr(start, '\n',
+			     client->length - (start - client->data)))) {
+		daemon_enqueue(queue, start, end - start);
+		start = end + 1;
+	}
+	client->length -= start - client->data;
+	memmove(client->data, start, client->length);
 
-	rc = read(rwepipe[1], small, smalllen);
-	if (rc < 0 || rc > biglen)
-		goto error_free_small;
+	/* nobody gets to send us an endless line */
+	if (client->length == sizeof(client->data))
+		return -E2BIG;
+	return 0;
+}
 
-	if (strncmp(small, "http://", 7))
-		goto error_free_small;
+/* Send out everything that queued up, all over the same warm handle */
+static void daemon_flush(struct session *session, struct daemon_queue *queue)
+{
+	double begin;
+	int retval;
+	int i;
 
-	smalllen = rc;
-	while (smalllen && isspace(small[smalllen-1]))
-			small[--smalllen] = 0;
+	for (i = 0; i < queue->count; i++) {
+		session->tweet = queue->items[i];
+		if (session->shrink_urls)
+			session->tweet = shrink_urls(session, session->tweet);
+		dbg("tweet = %s\n", session->tweet);
 
-	free(big);
-	return small;
+		begin = monotonic_time();
+		retval = send_update(session);
+		log_session(session, retval, begin);
 
-error_free_small:
-	free(small);
-	return big;
+		free(session->tweet);
+		session->tweet = NULL;
+	}
+	queue->count = 0;
+	/* the daemon may sit idle for a long time after this */
+	log_flush(session->log);
 }
 
-static char *shrink_urls(char *text)
+static int run_daemon(struct session *session)
 {
-	int *ranges;
-	int rcount;
+	struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+	struct daemon_client *clients[DAEMON_MAX_CLIENTS];
+	struct daemon_queue queue = { };
+	struct sockaddr_un addr;
+	int nclients = 0;
+	int listen_fd;
+	int fd;
+	int rc;
 	int i;
-	int inofs = 0;
-	int outofs = 0;
-	const char *const shrink_args[] = {
-		"bti-shrink-urls",
-		NULL
-	};
-	int shrink_pid;
-	int shrink_pipe[3];
-	int inlen = strlen(text);
 
-	dbg("before len=%u\n", inlen);
+	/* whatever the config file says, btid only ever posts */
+	session->action = ACTION_UPDATE;
 
-	shrink_pid = popenRWE(shrink_pipe, shrink_args[0], shrink_args);
-	if (shrink_pid < 0)
-		return text;
+	listen_fd = daemon_listen(session);
+	if (listen_fd < 0)
+		return -EINVAL;
 
-	rcount = find_urls(text, &ranges);
-	if (!rcount)
-		return text;
+	if (!debug && daemon(1, 0) < 0) {
+		close(listen_fd);
+		return -errno;
+	}
 
-	for (i = 0; i < rcount; i += 2) {
-		int url_start = ranges[i];
-		int url_end = ranges[i+1];
-		int long_url_len = url_end - url_start;
-		char *url = strndup(text + url_start, long_url_len);
-		int short_url_len;
-		int not_url_len = url_start - inofs;
-
-		dbg("long  url[%u]: %s\n", long_url_len, url);
-		url = shrink_one_url(shrink_pipe, url);
-		short_url_len = url ? strlen(url) : 0;
-		dbg("short url[%u]: %s\n", short_url_len, url);
-
-		if (!url || short_url_len >= long_url_len) {
-			/* The short url ended up being too long
-			 * or unavailable */
-			if (inofs) {
-				strncpy(text + outofs, text + inofs,
-						not_url_len + long_url_len);
-			}
-			inofs += not_url_len + long_url_len;
-			outofs += not_url_len + long_url_len;
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, daemon_signal);
+	signal(SIGINT, daemon_signal);
+	dbg("waiting for updates\n");
+
+	while (!daemon_stop) {
+		fds[0].fd = listen_fd;
+		fds[0].events = nclients < DAEMON_MAX_CLIENTS ? POLLIN : 0;
+		for (i = 0; i < nclients; i++) {
+			fds[i + 1].fd = clients[i]->fd;
+			fds[i + 1].events = POLLIN;
+		}
 
-		} else {
-			/* copy the unmodified block */
-			strncpy(text + outofs, text + inofs, not_url_len);
-			inofs += not_url_len;
-			outofs += not_url_len;
+		rc = poll(fds, nclients + 1, -1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
 
-			/* copy the new url */
-			strncpy(text + outofs, url, short_url_len);
-			inofs += long_url_len;
-			outofs += short_url_len;
+		/* drain the clients first, the loop below reshuffles them */
+		for (i = nclients - 1; i >= 0; i--) {
+			if (!fds[i + 1].revents)
+				continue;
+			if (!daemon_read_client(clients[i], &queue))
+				continue;
+			close(clients[i]->fd);
+			free(clients[i]);
+			clients[i] = clients[--nclients];
 		}
 
-		free(url);
+		if (fds[0].revents & POLLIN) {
+			while (nclients < DAEMON_MAX_CLIENTS) {
+				fd = accept(listen_fd, NULL, NULL);
+				if (fd < 0)
+					break;
+				clients[nclients] = zalloc(sizeof(**clients));
+				if (!clients[nclients]) {
+					close(fd);
+					break;
+				}
+				clients[nclients++]->fd = fd;
+			}
+		}
+
+		daemon_flush(session, &queue);
 	}
 
-	/* copy the last block after the last match */
-	if (inofs) {
-		int tail = inlen - inofs;
-		if (tail) {
-			strncpy(text + outofs, text + inofs, tail);
-			outofs += tail;
+	for (i = 0; i < nclients; i++) {
+		close(clients[i]->fd);
+		free(clients[i]);
+	}
+	free(queue.items);
+	close(listen_fd);
+	if (!daemon_socket_addr(session, &addr))
+		unlink(addr.sun_path);
+	return 0;
+}
+
+/*
+ * Send every status read from the batch file, one per line or NUL
+ * separated, over the handles of the session so the connection is set
+ * up only once.  With a rate set the updates are spaced out evenly.
+ */
+static int run_batch(struct session *session)
+{
+	FILE *file = stdin;
+	unsigned long count = 0;
+	unsigned long failed = 0;
+	double start;
+	double begin;
+	double next;
+	double now;
+	char *item;
+	int retval;
+
+	if (strcmp(session->batch, "-")) {
+		file = fopen(session->batch, "r");
+		if (!file) {
+			fprintf(stderr, "can not open %s: %s\n",
+				session->batch, strerror(errno));
+			return -errno;
 		}
 	}
 
-	free(ranges);
+	session->action = ACTION_UPDATE;
+	start = next = monotonic_time();
 
-	(void)pcloseRWE(shrink_pid, shrink_pipe);
+	while ((item = get_string(file, session->batch_delim))) {
+		if (!item[0]) {
+			free(item);
+			continue;
+		}
 
-	text[outofs] = 0;
-	dbg("after len=%u\n", outofs);
-	return text;
+		if (session->rate > 0) {
+			now = monotonic_time();
+			if (next > now)
+				sleep_for(next - now);
+			else
+				next = now;
+			next += 1 / session->rate;
+		}
+
+		session->tweet = item;
+		if (session->shrink_urls)
+			session->tweet = shrink_urls(session, session->tweet);
+		dbg("tweet = %s\n", session->tweet);
+
+		begin = monotonic_time();
+		retval = send_update(session);
+		now = monotonic_time();
+		log_session(session, retval, begin);
+
+		count++;
+		if (retval)
+			failed++;
+		printf("%lu: %s in %.0f ms: %s\n", count,
+		       retval ? "failed" : "ok", (now - begin) * 1000,
+		       session->tweet);
+		fflush(stdout);
+
+		free(session->tweet);
+		session->tweet = NULL;
+	}
+
+	now = monotonic_time() - start;
+	printf("sent %lu of %lu updates in %.2f s, %.1f updates/s\n",
+	       count - failed, count, now, now > 0 ? count / now : 0.0);
+
+	if (file != stdin)
+		fclose(file);
+	return failed ? -EINVAL : 0;
+}
+
+static volatile sig_atomic_t follow_stop;
+
+static void follow_signal(int sig)
+{
+	follow_stop = 1;
+}
+
+/*
+ * Poll a timeline until we are told to stop.  The curl handle, and with
+ * it the connection, is kept from one poll to the next, and every poll
+ * only asks for what is newer than the newest status seen so far.  The
+ * interval halves when a poll brings something new, drops to the
+ * minimum when it brings a lot, and grows by half when it brings
+ * nothing, between the bounds of --follow-interval.
+ */
+static int run_follow(struct session *session)
+{
+	double interval = session->follow_min;
+	unsigned long statuses;
+	double begin;
+	struct timespec ts;
+	int retval = 0;
+
+	signal(SIGTERM, follow_signal);
+	signal(SIGINT, follow_signal);
+
+	while (!follow_stop) {
+		begin = monotonic_time();
+		statuses = session->statuses;
+		retval = send_request(session);
+		statuses = session->statuses - statuses;
+		log_session(session, retval, begin);
+
+		if (retval)
+			interval = session->follow_max;
+		else if (statuses >= STATUS_PAGE_SIZE / 2)
+			interval = session->follow_min;
+		else if (statuses)
+			interval /= 2;
+		else
+			interval *= 1.5;
+		if (interval < session->follow_min)
+			interval = session->follow_min;
+		if (interval > session->follow_max)
+			interval = session->follow_max;
+
+		if (session->max_id > session->since_id) {
+			if (session->incremental)
+				since_save(session);
+			session->since_id = session->max_id;
+			if (session->store)
+				search_index_update(session->store,
+						    session->homedir);
+		}
+		output_flush(session->output);
+		log_flush(session->log);
+
+		dbg("%lu new, next poll in %.1f s\n", statuses, interval);
+		ts.tv_sec = interval;
+		ts.tv_nsec = (interval - ts.tv_sec) * 1e9;
+		while (!follow_stop && nanosleep(&ts, &ts) < 0 &&
+		       errno == EINTR)
+			;
+	}
+	return retval;
 }
 
 int main(int argc, char *argv[], char *envp[])
@@ -914,8 +6555,25 @@ int main(int argc, char *argv[], char *envp[])
 		{ "shrink-urls", 0, NULL, 's' },
 		{ "help", 0, NULL, 'h' },
 		{ "bash", 0, NULL, 'b' },
+		{ "daemon", 0, NULL, 'D' },
+		{ "batch", 1, NULL, 'B' },
+		{ "null", 0, NULL, '0' },
+		{ "rate", 1, NULL, 'r' },
 		{ "dry-run", 0, NULL, 'n' },
 		{ "page", 1, NULL, 'g' },
+		{ "pages", 1, NULL, 'G' },
+		{ "jobs", 1, NULL, 'j' },
+		{ "max-body", 1, NULL, 'm' },
+		{ "incremental", 0, NULL, 'I' },
+		{ "stats", 0, NULL, 'S' },
+		{ "query", 1, NULL, 'q' },
+		{ "follow", 0, NULL, 'F' },
+		{ "format", 1, NULL, 'f' },
+		{ "follow-interval", 1, NULL, 'i' },
+		{ "since", 1, NULL, 'W' },
+		{ "until", 1, NULL, 'U' },
+		{ "from", 1, NULL, 'w' },
+		{ "grep", 1, NULL, 'e' },
 		{ "version", 0, NULL, 'v' },
 		{ }
 	};
@@ -925,12 +6583,12 @@ int main(int argc, char *argv[], char *envp[])
 	int retval = 0;
 	int option;
 	char *http_proxy;
-	time_t t;
+	double begin;
+	time_t when;
 	int page_nr;
 
 	debug = 0;
 	verbose = 0;
-	rl_bind_key('\t', rl_insert);
 
 	session = session_alloc();
 	if (!session) {
@@ -938,14 +6596,13 @@ int main(int argc, char *argv[], char *envp[])
 		return -1;
 	}
 
-	/* get the current time so that we can log it later */
-	time(&t);
-	session->time = strdup(ctime(&t));
-	session->time[strlen(session->time)-1] = 0x00;
+	session->times.start = monotonic_time();
 
-	session->homedir = strdup(getenv("HOME"));
+	/* installed as btid we are the resident daemon */
+	if (!strcmp(basename(argv[0]), "btid"))
+		session->daemon = 1;
 
-	curl_global_init(CURL_GLOBAL_ALL);
+	session->homedir = strdup(getenv("HOME"));
 
 	/* Set environment variables first, before reading command line options
 	 * or config file values. */
@@ -957,7 +6614,9 @@ int main(int argc, char *argv[], char *envp[])
 		dbg("http_proxy = %s\n", session->proxy);
 	}
 
+	session->times.config = monotonic_time();
 	parse_configfile(session);
+	session->times.config = monotonic_time() - session->times.config;
 
 	while (1) {
 		option = getopt_long_only(argc, argv, "dp:P:H:a:A:u:hg:snVv",
@@ -982,6 +6641,23 @@ int main(int argc, char *argv[], char *envp[])
 			dbg("page = %d\n", page_nr);
 			session->page = page_nr;
 			break;
+		case 'G':
+			if (sscanf(optarg, "%d-%d", &session->page,
+				   &session->last_page) != 2 ||
+			    session->page < 1 ||
+			    session->last_page < session->page) {
+				fprintf(stderr, "invalid page range %s\n",
+					optarg);
+				retval = -EINVAL;
+				goto exit;
+			}
+			dbg("pages = %d-%d\n", session->page,
+			    session->last_page);
+			break;
+		case 'j':
+			session->jobs = atoi(optarg);
+			dbg("jobs = %d\n", session->jobs);
+			break;
 		case 'p':
 			if (session->password)
 				free(session->password);
@@ -995,18 +6671,7 @@ int main(int argc, char *argv[], char *envp[])
 			dbg("proxy = %s\n", session->proxy);
 			break;
 		case 'A':
-			if (strcasecmp(optarg, "update") == 0)
-				session->action = ACTION_UPDATE;
-			else if (strcasecmp(optarg, "friends") == 0)
-				session->action = ACTION_FRIENDS;
-			else if (strcasecmp(optarg, "user") == 0)
-				session->action = ACTION_USER;
-			else if (strcasecmp(optarg, "replies") == 0)
-				session->action = ACTION_REPLIES;
-			else if (strcasecmp(optarg, "public") == 0)
-				session->action = ACTION_PUBLIC;
-			else
-				session->action = ACTION_UNKNOWN;
+			parse_actions(session, optarg);
 			dbg("action = %d\n", session->action);
 			break;
 		case 'u':
@@ -1024,24 +6689,97 @@ int main(int argc, char *argv[], char *envp[])
 		case 's':
 			session->shrink_urls = 1;
 			break;
+		case 'I':
+			session->incremental = 1;
+			break;
+		case 'S':
+			session->stats = 1;
+			break;
+		case 'F':
+			session->follow = 1;
+			break;
+		case 'f':
+			if (parse_format(optarg, &session->format)) {
+				fprintf(stderr, "Unknown format %s, valid "
+					"formats are 'human', 'json', 'tsv' "
+					"or 'nul'.\n", optarg);
+				retval = -EINVAL;
+				goto exit;
+			}
+			break;
+		case 'i':
+			parse_interval(session, optarg);
+			break;
+		case 'W':
+		case 'U':
+			when = parse_when(optarg);
+			if (when < 0) {
+				fprintf(stderr, "Unknown time %s, use "
+					"seconds since the epoch, "
+					"YYYY-MM-DD[ HH:MM[:SS]] or an age "
+					"like 6h or 2d.\n", optarg);
+				retval = -EINVAL;
+				goto exit;
+			}
+			if (option == 'W')
+				session->since = when;
+			else
+				session->until = when;
+			dbg("window = %ld-%ld\n", (long)session->since,
+			    (long)session->until);
+			break;
+		case 'w':
+			if (status_filter_from(&session->filter, optarg)) {
+				fprintf(stderr, "no more memory...\n");
+				retval = -ENOMEM;
+				goto exit;
+			}
+			break;
+		case 'e':
+			retval = status_filter_grep(&session->filter, optarg);
+			if (retval)
+				goto exit;
+			dbg("grep = %s\n", session->filter.grep);
+			break;
+		case 'q':
+			free(session->query);
+			session->query = strdup(optarg);
+			dbg("query = %s\n", session->query);
+			break;
+		case 'm':
+			if (parse_size(optarg, &session->max_body)) {
+				fprintf(stderr, "invalid --max-body %s\n",
+					optarg);
+				retval = -EINVAL;
+				goto exit;
+			}
+			dbg("max_body = %zu\n", session->max_body);
+			break;
 		case 'H':
 			if (session->hosturl)
 				free(session->hosturl);
-			if (strcasecmp(optarg, "twitter") == 0) {
-				session->host = HOST_TWITTER;
-				session->hosturl = strdup(twitter_host);
-			} else if (strcasecmp(optarg, "identica") == 0) {
-				session->host = HOST_IDENTICA;
-				session->hosturl = strdup(identica_host);
-			} else {
-				session->host = HOST_CUSTOM;
-				session->hosturl = strdup(optarg);
-			}
+			session->hosturl = parse_host(optarg, &session->host);
+			session->host_override = 1;
 			dbg("host = %d\n", session->host);
 			break;
 		case 'b':
 			session->bash = 1;
 			break;
+		case 'D':
+			session->daemon = 1;
+			break;
+		case 'B':
+			free(session->batch);
+			session->batch = strdup(optarg);
+			dbg("batch = %s\n", session->batch);
+			break;
+		case '0':
+			session->batch_delim = '\0';
+			break;
+		case 'r':
+			session->rate = atof(optarg);
+			dbg("rate = %g\n", session->rate);
+			break;
 		case 'h':
 			display_help();
 			goto exit;
@@ -1067,33 +6805,80 @@ int main(int argc, char *argv[], char *envp[])
 	if (session->action == ACTION_UNKNOWN) {
 		fprintf(stderr, "Unknown action, valid actions are:\n");
 		fprintf(stderr, "'update', 'friends', 'public', "
-			"'replies' or 'user'.\n");
+			"'replies', 'user' or 'search', or one of the "
+			"timelines prefixed with 'local-'.\n");
+		fprintf(stderr, "'friends', 'public', 'replies' and 'user' "
+			"can be merged in a comma separated list.\n");
+		goto exit;
+	}
+
+	session->output = output_alloc(STDOUT_FILENO, session->format);
+	if (!session->output) {
+		fprintf(stderr, "no more memory...\n");
+		retval = -ENOMEM;
+		goto exit;
+	}
+
+	/* the local store needs neither the network nor credentials */
+	if (session->local || session->action == ACTION_SEARCH) {
+		if (!session->user)
+			session->user = strdup(session->account ?
+					       session->account : "");
+		if (session->page == 0)
+			session->page = 1;
+		if (session->local) {
+			retval = query_store(session);
+		} else {
+			if (!session->query)
+				session->query = read_line("search: ");
+			session->store = status_store_open(session->homedir);
+			if (session->query)
+				retval = search_store(session);
+		}
+		if (retval)
+			fprintf(stderr, "operation failed\n");
+		goto exit;
+	}
+
+	/* the updates of "--batch -" are on stdin, where a prompt would read */
+	if (session->batch && !strcmp(session->batch, "-") &&
+	    (!session->account || !session->password)) {
+		fprintf(stderr, "--batch - needs the account and password "
+			"in ~/.bti or on the command line\n");
+		retval = -EINVAL;
 		goto exit;
 	}
 
 	if (!session->account) {
 		fprintf(stdout, "Enter twitter account: ");
-		session->account = readline(NULL);
+		session->account = read_line(NULL);
 	}
 
 	if (!session->password) {
 		fprintf(stdout, "Enter twitter password: ");
-		session->password = readline(NULL);
+		session->password = read_line(NULL);
+	}
+
+	if (session->daemon) {
+		retval = run_daemon(session);
+		goto exit;
+	}
+
+	if (session->batch) {
+		retval = run_batch(session);
+		goto exit;
 	}
 
 	if (session->action == ACTION_UPDATE) {
 		if (session->bash)
 			tweet = get_string_from_stdin();
 		else
-			tweet = readline("tweet: ");
+			tweet = read_line("tweet: ");
 		if (!tweet || strlen(tweet) == 0) {
 			dbg("no tweet?\n");
 			return -1;
 		}
 
-		if (session->shrink_urls)
-			tweet = shrink_urls(tweet);
-
 		session->tweet = zalloc(strlen(tweet) + 10);
 		if (session->bash)
 			sprintf(session->tweet, "%c %s", getuid() ? '$' : '#', tweet);
@@ -1101,6 +6886,17 @@ int main(int argc, char *argv[], char *envp[])
 			sprintf(session->tweet, "%s", tweet);
 
 		free(tweet);
+
+		/*
+		 * If btid is running it does all of the work, including
+		 * shrinking the urls, and the shell can move on right away.
+		 */
+		if (session->bash && !session->dry_run &&
+		    !daemon_submit(session))
+			goto exit;
+
+		if (session->shrink_urls)
+			session->tweet = shrink_urls(session, session->tweet);
 		dbg("tweet = %s\n", session->tweet);
 	}
 
@@ -1125,12 +6921,59 @@ int main(int argc, char *argv[], char *envp[])
 		}
 	}
 
-	retval = send_request(session);
+	if (timeline_merging(session) &&
+	    (session->follow || session->last_page > session->page)) {
+		fprintf(stderr, "--follow and --pages read a single "
+			"timeline\n");
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	/* since_id is per timeline, so a merge reads all of them again */
+	if (session->incremental && session->action != ACTION_UPDATE &&
+	    !timeline_merging(session))
+		since_load(session);
+
+	if (session->store_enabled && session->action != ACTION_UPDATE &&
+	    !session->dry_run)
+		session->store = status_store_open(session->homedir);
+
+	begin = monotonic_time();
+	if (session->action == ACTION_UPDATE)
+		retval = send_update(session);
+	else if (timeline_merging(session))
+		retval = fetch_merged(session);
+	else if (session->follow)
+		retval = run_follow(session);
+	else if (session->last_page > session->page)
+		retval = fetch_pages(session);
+	else
+		retval = send_request(session);
 	if (retval && !session->bash)
 		fprintf(stderr, "operation failed\n");
 
-	log_session(session, retval);
+	if (!retval && session->incremental &&
+	    session->action != ACTION_UPDATE && !timeline_merging(session))
+		since_save(session);
+
+	if (session->requests)
+		dbg("%llu bytes on the wire for %llu bytes of timeline, "
+		    "%d of %d conditional requests not modified\n",
+		    session->wire_bytes, session->body_bytes,
+		    session->not_modified, session->conditional);
+
+	/* index whatever this fetch added to the store */
+	if (session->store)
+		search_index_update(session->store, session->homedir);
+
+	/* follow has logged every poll already */
+	if (!session->follow || session->action == ACTION_UPDATE)
+		log_session(session, retval, begin);
 exit:
+	if (session->stats && session->output) {
+		output_flush(session->output);
+		print_stats(session, retval);
+	}
 	session_free(session);
 	return retval;;
 }